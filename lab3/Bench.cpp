@@ -0,0 +1,135 @@
+#include <algorithm>
+#include <vector>
+#include <time.h>
+
+#include "sthread.h"
+#include "Bench.h"
+
+#define BENCH_RESERVE 65536
+
+/*
+ * One thread's latency samples. Logs are owned by the global list,
+ * not by the thread, so they survive sthread_exit.
+ */
+struct SampleLog {
+    std::vector<uint64_t> samples;
+    SampleLog* next;
+};
+
+static smutex_t logsLock = SMUTEX_INITIALIZER;
+static SampleLog* logs = NULL;
+static thread_local SampleLog* myLog = NULL;
+
+thread_local uint64_t bench_running = 0;
+
+/*
+ * ------------------------------------------------------------------
+ * bench_now_ns --
+ *
+ *      Read the monotonic clock.
+ *
+ * Results:
+ *      The current time in nanoseconds. Never 0.
+ *
+ * ------------------------------------------------------------------
+ */
+uint64_t
+bench_now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * bench_record --
+ *
+ *      Add one latency sample to the calling thread's log.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+bench_record(uint64_t latency_ns)
+{
+  SampleLog* log = myLog;
+  if (log == NULL){
+    log = new SampleLog();
+    log->samples.reserve(BENCH_RESERVE);
+    smutex_lock(&logsLock);
+    log->next = logs;
+    logs = log;
+    smutex_unlock(&logsLock);
+    myLog = log;
+  }
+  log->samples.push_back(latency_ns);
+}
+
+static double
+percentile_us(const std::vector<uint64_t>& sorted, double p)
+{
+  size_t i = (size_t) (p * (sorted.size() - 1) + 0.5);
+  return sorted[i] / 1000.0;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * bench_summary --
+ *
+ *      Merge the samples recorded so far by every thread. Call it
+ *      once the threads that record have finished.
+ *
+ * Results:
+ *      The sample count and latency percentiles in microseconds
+ *      (all zero if there are no samples).
+ *
+ * ------------------------------------------------------------------
+ */
+LatencySummary
+bench_summary()
+{
+  std::vector<uint64_t> all;
+  smutex_lock(&logsLock);
+  for (SampleLog* log = logs; log != NULL; log = log->next){
+    all.insert(all.end(), log->samples.begin(), log->samples.end());
+  }
+  smutex_unlock(&logsLock);
+
+  LatencySummary s = LatencySummary();
+  s.count = all.size();
+  if (all.empty()){
+    return s;
+  }
+  std::sort(all.begin(), all.end());
+  s.p50_us = percentile_us(all, 0.50);
+  s.p99_us = percentile_us(all, 0.99);
+  s.p999_us = percentile_us(all, 0.999);
+  s.max_us = all.back() / 1000.0;
+  return s;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * bench_reset --
+ *
+ *      Throw away every sample recorded so far, to start measuring
+ *      a new round. As with bench_summary, no thread may be
+ *      recording while it runs.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+bench_reset()
+{
+  smutex_lock(&logsLock);
+  for (SampleLog* log = logs; log != NULL; log = log->next){
+    log->samples.clear();
+  }
+  smutex_unlock(&logsLock);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+
+#include "Task.h"
+
+/*
+ * ------------------------------------------------------------------
+ * Benchmark timing --
+ *
+ *      Producers stamp Task::enqueued with bench_now_ns just before
+ *      handing a task over; whoever runs the task calls
+ *      bench_task_start and bench_task_done around it, which records
+ *      the enqueue-to-completion latency in a per-thread sample log
+ *      (no locks on the hot path). bench_summary merges every
+ *      thread's samples.
+ *
+ *      A task that may finish later than it returns (a coroutine
+ *      that suspends) calls bench_defer before its first suspension
+ *      to take the timing over, and bench_finish when it completes.
+ *
+ * ------------------------------------------------------------------
+ */
+
+struct LatencySummary {
+    long count;
+    double p50_us;
+    double p99_us;
+    double p999_us;
+    double max_us;
+};
+
+uint64_t bench_now_ns();
+void bench_record(uint64_t latency_ns);
+LatencySummary bench_summary();
+void bench_reset();
+
+// Enqueue time of the task this thread is running, or 0 if it is
+// not timed or its timing was deferred.
+extern thread_local uint64_t bench_running;
+
+static inline void
+bench_task_start(const Task& task)
+{
+    bench_running = task.enqueued;
+}
+
+static inline void
+bench_task_done()
+{
+    if (bench_running != 0){
+        bench_record(bench_now_ns() - bench_running);
+        bench_running = 0;
+    }
+}
+
+static inline uint64_t
+bench_defer()
+{
+    uint64_t enqueued = bench_running;
+    bench_running = 0;
+    return enqueued;
+}
+
+static inline void
+bench_finish(uint64_t enqueued)
+{
+    if (enqueued != 0){
+        bench_record(bench_now_ns() - enqueued);
+    }
+}
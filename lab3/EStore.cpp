@@ -1,9 +1,23 @@
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstdint>
 
 #include "EStore.h"
 
 using namespace std;
 
+// Deadline of a purchase that never times out.
+#define PURCHASE_NO_DEADLINE UINT64_MAX
+
+// Outcome of checking (or trying to buy) an item or an order.
+enum OrderStatus {
+    ORDER_OK = 0,
+    ORDER_UNAVAILABLE,
+    ORDER_BLOCKED,
+    ORDER_CONFLICT
+};
+
 
 Item::
 Item() : valid(false), quantity(0)
@@ -15,76 +29,1152 @@ Item::
 {
 }
 
+CancelToken::
+CancelToken() : cancelled(false), links(NULL)
+{
+  smutex_init(&lock);
+}
+
+CancelToken::
+~CancelToken()
+{
+  assert(links == NULL);
+  smutex_destroy(&lock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * cancel --
+ *
+ *      Cancel every purchase made with this token, now and later,
+ *      and wake those that are waiting.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void CancelToken::
+cancel()
+{
+  smutex_lock(&lock);
+  cancelled.store(true);
+  for (CancelLink* link = links; link != NULL; link = link->next){
+    smutex_lock(link->lock);
+    scond_broadcast(link->cond, link->lock);
+    smutex_unlock(link->lock);
+  }
+  smutex_unlock(&lock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * attach --
+ *
+ *      Register a purchase about to wait on link->cond under
+ *      link->lock, which the caller must not hold.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void CancelToken::
+attach(CancelLink* link)
+{
+  smutex_lock(&lock);
+  link->next = links;
+  links = link;
+  smutex_unlock(&lock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * detach --
+ *
+ *      Undo attach, before link's condition variable goes away.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void CancelToken::
+detach(CancelLink* link)
+{
+  smutex_lock(&lock);
+  CancelLink** p = &links;
+  while (*p != link){
+    p = &(*p)->next;
+  }
+  *p = link->next;
+  smutex_unlock(&lock);
+}
+
+/*
+ * Turn a purchase timeout into a deadline for purchase_wait.
+ */
+static uint64_t
+purchase_deadline(long timeoutNs)
+{
+  if (timeoutNs < 0){
+    return PURCHASE_NO_DEADLINE;
+  }
+  return sthread_now_ns() + timeoutNs;
+}
+
+/*
+ * Wait on cond until signaled or deadline. Returns false if the
+ * deadline passed.
+ */
+static bool
+purchase_wait(scond_t* cond, smutex_t* mutex, uint64_t deadline)
+{
+  if (deadline == PURCHASE_NO_DEADLINE){
+    scond_wait(cond, mutex);
+    return true;
+  }
+  return scond_timedwait(cond, mutex, deadline);
+}
+
+
+EStore::
+EStore(bool enableFineMode, bool enableWaitForOrders, bool enableOptimistic)
+    : fineMode(enableFineMode), waitForOrders(enableWaitForOrders),
+      optimistic(enableOptimistic),
+      shipping_cost(3), store_discount(0),
+      waitedSlots(NULL), orderWaiters(NULL),
+      orderWaiterCount(0), orderWaits(0), orderWakeups(0), orderSpuriousWakeups(0),
+      closed(false), occCommits(0), occRejects(0), occConflicts(0), occFallbacks(0),
+      fastBuys(0), readyWaiters(NULL), readyTail(&readyWaiters), asyncPending(0)
+{
+  assert(fineMode || !optimistic);
+  smutex_init(&lock);
+  smutex_init(&orderWaitersLock);
+  itemWaiterCount = 0;
+  stats.waits = 0;
+  stats.wakeups = 0;
+  stats.spurious_wakeups = 0;
+  stats.async_waits = 0;
+  stats.async_peak = 0;
+  for (int i = 0; i < NUM_PURCHASE_RESULTS; i++){
+    purchases[i] = 0;
+  }
+}
 
 EStore::
-EStore(bool enableFineMode)
-    : fineMode(enableFineMode)
+~EStore()
+{
+  smutex_destroy(&orderWaitersLock);
+  smutex_destroy(&lock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * readPricing --
+ *
+ *      Read the shipping cost and store discount as a consistent
+ *      pair, without taking the store lock. If version is not NULL,
+ *      the seqlock version the pair belongs to is stored there; the
+ *      pair is still current as long as pricingLock.version() is
+ *      unchanged.
+ *
+ * Results:
+ *      The pricing parameters.
+ *
+ * ------------------------------------------------------------------
+ */
+Pricing EStore::
+readPricing(unsigned* version) const
+{
+  Pricing p;
+  unsigned v;
+  do {
+    v = pricingLock.readBegin();
+    p.shipping_cost = shipping_cost.load(std::memory_order_relaxed);
+    p.store_discount = store_discount.load(std::memory_order_relaxed);
+  } while (pricingLock.readRetry(v));
+  if (version != NULL){
+    *version = v;
+  }
+  return p;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * itemCost --
+ *
+ *      The cost of buying one unit of the item under the given
+ *      pricing: its discounted price, less the store discount, plus
+ *      shipping.
+ *
+ * Results:
+ *      The cost of the item.
+ *
+ * ------------------------------------------------------------------
+ */
+double EStore::
+itemCost(const Item& item, const Pricing& pricing)
+{
+  return item.price * (1 - item.discount) * (1 - pricing.store_discount)
+      + pricing.shipping_cost;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * loadItem --
+ *
+ *      Read the item in slot without its lock. Each field is read
+ *      atomically and the copy is retried until slot->version shows
+ *      no update overlapped it. If version is not NULL, the
+ *      version the copy belongs to is stored there.
+ *
+ * Results:
+ *      A consistent copy of the item.
+ *
+ * ------------------------------------------------------------------
+ */
+Item EStore::
+loadItem(const ItemSlot* slot, unsigned* version)
+{
+  Item item;
+  unsigned start;
+  do {
+    start = slot->version.readBegin();
+    __atomic_load(&slot->item.valid, &item.valid, __ATOMIC_RELAXED);
+    __atomic_load(&slot->item.quantity, &item.quantity, __ATOMIC_RELAXED);
+    __atomic_load(&slot->item.price, &item.price, __ATOMIC_RELAXED);
+    __atomic_load(&slot->item.discount, &item.discount, __ATOMIC_RELAXED);
+  } while (slot->version.readRetry(start));
+  if (version != NULL){
+    *version = start;
+  }
+  return item;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * beginItemUpdate --
+ *
+ *      Start changing the item in slot: make slot->version odd,
+ *      which also shuts out the lock-free purchase in takeItem, and
+ *      return the current item. Called with the lock that protects
+ *      the item held (slot->lock in fine mode, the store lock
+ *      otherwise). Finish with endItemUpdate.
+ *
+ * Results:
+ *      The item as it is now.
+ *
+ * ------------------------------------------------------------------
+ */
+Item EStore::
+beginItemUpdate(ItemSlot* slot)
+{
+  slot->version.writeBegin();
+  return slot->item;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * endItemUpdate --
+ *
+ *      Store the new value of the item in slot and publish it to
+ *      lock-free readers.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+endItemUpdate(ItemSlot* slot, const Item& item)
+{
+  __atomic_store(&slot->item.valid, &item.valid, __ATOMIC_RELAXED);
+  __atomic_store(&slot->item.quantity, &item.quantity, __ATOMIC_RELAXED);
+  __atomic_store(&slot->item.price, &item.price, __ATOMIC_RELAXED);
+  __atomic_store(&slot->item.discount, &item.discount, __ATOMIC_RELAXED);
+  slot->version.writeEnd();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * takeItem --
+ *
+ *      Try to buy one unit of the item in slot without taking a
+ *      lock: read the item and the pricing, check that the item is
+ *      carried, in stock and within budget, then claim the item's
+ *      version with a CAS (which fails if anything changed the item
+ *      since we read it) and store the lower quantity.
+ *
+ *      A failed CAS is retried up to attempts times; a negative
+ *      attempts retries until the outcome is decided.
+ *
+ * Results:
+ *      ORDER_OK if a unit was bought, ORDER_UNAVAILABLE if the store
+ *      does not carry the item, ORDER_BLOCKED if it is out of stock
+ *      or over budget, or ORDER_CONFLICT if every attempt lost a
+ *      race.
+ *
+ * ------------------------------------------------------------------
+ */
+int EStore::
+takeItem(ItemSlot* slot, double budget, int attempts)
+{
+  for (int i = 0; attempts < 0 || i < attempts; i++){
+    unsigned version;
+    Item item = loadItem(slot, &version);
+    if (!item.valid){
+      return ORDER_UNAVAILABLE;
+    }
+    unsigned pricingVersion;
+    Pricing pricing = readPricing(&pricingVersion);
+    if (item.quantity == 0 || itemCost(item, pricing) > budget){
+      return ORDER_BLOCKED;
+    }
+    if (pricingLock.version() != pricingVersion
+        || !slot->version.tryWriteBegin(version)){
+      cpu_relax();
+      continue;
+    }
+    int quantity = item.quantity - 1;
+    __atomic_store(&slot->item.quantity, &quantity, __ATOMIC_RELAXED);
+    slot->version.writeEnd();
+    return ORDER_OK;
+  }
+  return ORDER_CONFLICT;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * wakeItemWaiters --
+ *
+ *      Called with the store lock held after the item in slot
+ *      changed. Wake the waiters that can now buy it, oldest first,
+ *      but no more than there are units in stock (counting waiters
+ *      that were woken earlier and have not run yet). If the item
+ *      was removed, wake everybody so they can return. A woken
+ *      waiter that still cannot buy calls this again, so its share
+ *      of the stock passes on to the waiters behind it.
+ *
+ *      Coroutine waiters are not woken to retry: the unit is bought
+ *      for them here and they are moved to the ready list, to be
+ *      resumed by unlockStore.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+wakeItemWaiters(ItemSlot* slot)
+{
+  Item item = loadItem(slot, NULL);
+  ItemWaiter** link = &slot->waiters;
+  if (!item.valid){
+    while (*link != NULL){
+      ItemWaiter* w = *link;
+      w->removed = true;
+      w->woken = true;
+      if (w->handle){
+        readyAsyncWaiter(slot, link);
+      } else {
+        scond_signal(&w->cond, &lock);
+        link = &w->next;
+      }
+    }
+    return;
+  }
+
+  int quota = item.quantity;
+  double cost = itemCost(item, readPricing(NULL));
+  while (*link != NULL && quota > 0){
+    ItemWaiter* w = *link;
+    if (w->woken){
+      quota--;
+    } else if (cost <= w->budget && w->handle){
+      if (takeItem(slot, w->budget, -1) != ORDER_OK){
+        // A lock-free buyer took the last unit.
+        break;
+      }
+      w->woken = true;
+      readyAsyncWaiter(slot, link);
+      quota--;
+      continue;
+    } else if (cost <= w->budget){
+      w->woken = true;
+      scond_signal(&w->cond, &lock);
+      quota--;
+    }
+    link = &w->next;
+  }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * readyAsyncWaiter --
+ *
+ *      Called with the store lock held. Unlink the coroutine waiter
+ *      at *link from its item and append it to the ready list.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+readyAsyncWaiter(ItemSlot* slot, ItemWaiter** link)
+{
+  ItemWaiter* w = *link;
+  *link = w->next;
+  noteItemWaiters(slot);
+  slot->waiting.fetch_sub(1, std::memory_order_relaxed);
+  itemWaiterCount--;
+  asyncPending--;
+  countPurchase(w->removed ? PURCHASE_REMOVED : PURCHASE_BOUGHT);
+  w->next = NULL;
+  *readyTail = w;
+  readyTail = &w->next;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * unlockStore --
+ *
+ *      Release the store lock, then resume the coroutines that
+ *      wakeItemWaiters made ready, in the order they were readied.
+ *      They run to their next suspension point on this thread and
+ *      may call back into the store, which is why the lock is
+ *      released first.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+unlockStore()
+{
+  ItemWaiter* ready = readyWaiters;
+  readyWaiters = NULL;
+  readyTail = &readyWaiters;
+  smutex_unlock(&lock);
+  while (ready != NULL){
+    // The waiter lives in the coroutine frame, which may be gone
+    // once the coroutine is resumed.
+    ItemWaiter* w = ready;
+    ready = w->next;
+    w->handle.resume();
+  }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * wakeAllWaiters --
+ *
+ *      Called with the store lock held after a store-wide price
+ *      drop. Re-evaluate the waiters on every item that has any,
+ *      going through the list of waited-on slots rather than the
+ *      whole inventory.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+wakeAllWaiters()
+{
+  ItemSlot* slot = waitedSlots;
+  while (slot != NULL){
+    // Readying coroutine waiters may take the slot off the list.
+    ItemSlot* next = slot->nextWaited;
+    wakeItemWaiters(slot);
+    slot = next;
+  }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * noteItemWaiters --
+ *
+ *      Called with the store lock held after slot->waiters changed.
+ *      Put the slot on the list of waited-on slots if it now has
+ *      waiters, or take it off if it has none left.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+noteItemWaiters(ItemSlot* slot)
+{
+  if (slot->waiters != NULL && slot->waitedLink == NULL){
+    slot->nextWaited = waitedSlots;
+    if (waitedSlots != NULL){
+      waitedSlots->waitedLink = &slot->nextWaited;
+    }
+    waitedSlots = slot;
+    slot->waitedLink = &waitedSlots;
+  } else if (slot->waiters == NULL && slot->waitedLink != NULL){
+    *slot->waitedLink = slot->nextWaited;
+    if (slot->nextWaited != NULL){
+      slot->nextWaited->waitedLink = slot->waitedLink;
+    }
+    slot->nextWaited = NULL;
+    slot->waitedLink = NULL;
+  }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * getStats --
+ *
+ *      Return a copy of the blocked-purchase, optimistic-order and
+ *      purchase result counters.
+ *
+ * Results:
+ *      The counters.
+ *
+ * ------------------------------------------------------------------
+ */
+EStoreStats EStore::
+getStats()
+{
+  smutex_lock(&lock);
+  EStoreStats s = stats;
+  smutex_unlock(&lock);
+  s.order_waits = orderWaits.load();
+  s.order_wakeups = orderWakeups.load();
+  s.order_spurious_wakeups = orderSpuriousWakeups.load();
+  s.occ_commits = occCommits.load();
+  s.occ_rejects = occRejects.load();
+  s.occ_conflicts = occConflicts.load();
+  s.occ_fallbacks = occFallbacks.load();
+  s.fast_buys = fastBuys.load();
+  for (int i = 0; i < NUM_PURCHASE_RESULTS; i++){
+    s.purchases[i] = purchases[i].load();
+  }
+  return s;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * countPurchase --
+ *
+ *      Count a purchase that ended with result.
+ *
+ * Results:
+ *      result.
+ *
+ * ------------------------------------------------------------------
+ */
+int EStore::
+countPurchase(int result)
+{
+  purchases[result].fetch_add(1, std::memory_order_relaxed);
+  return result;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyItem --
+ *
+ *      Attempt to buy the item from the store.
+ *
+ *      An item can be bought if:
+ *          - The store carries it.
+ *          - The item is in stock.
+ *          - The cost of the item plus the cost of shipping is no
+ *            more than the budget.
+ *
+ *      If the store *does not* carry this item, simply return and
+ *      do nothing. Do not attempt to buy the item.
+ *
+ *      If the store *does* carry the item, but it is not in stock
+ *      or its cost is over budget, block until both conditions are
+ *      met (at which point the item should be bought) or the store
+ *      removes the item from sale (at which point this method
+ *      returns).
+ *
+ *      The overall cost of a purchase for a single item is defined
+ *      as the current cost of the item times 1 - the store
+ *      discount, plus the flat overall store shipping fee.
+ *
+ *      See buyItemFor, which does the work.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+buyItem(int item_id, double budget)
+{
+    buyItemFor(item_id, budget, PURCHASE_NO_TIMEOUT);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyItemFor --
+ *
+ *      buyItem, but give up waiting after timeoutNs nanoseconds
+ *      (never if negative, at once if 0), or when cancel, if not
+ *      NULL, is cancelled.
+ *
+ *      A blocked buyer queues an ItemWaiter on the item and is
+ *      only woken by wakeItemWaiters when it can afford the item,
+ *      the item is removed, or the token is cancelled.
+ *
+ *      The purchase itself is a CAS on the item's version (see
+ *      takeItem). An item that is carried, in stock and affordable
+ *      is bought that way without taking the store lock at all; the
+ *      lock is only needed to decide to block and to queue.
+ *
+ * Results:
+ *      The PurchaseResult: bought, removed, declined (timeoutNs was
+ *      0), timed out or cancelled.
+ *
+ * ------------------------------------------------------------------
+ */
+int EStore::
+buyItemFor(int item_id, double budget, long timeoutNs, CancelToken* cancel)
+{
+    assert(!fineModeEnabled());
+    uint64_t deadline = purchase_deadline(timeoutNs);
+    ItemSlot* slot;
+    int status = buyItemFast(item_id, budget, &slot);
+    if (status != ORDER_BLOCKED){
+      return countPurchase(status == ORDER_OK ? PURCHASE_BOUGHT : PURCHASE_REMOVED);
+    }
+
+    // cancel() takes the token's lock before ours, so the waiter is
+    // attached before locking, whether or not it ends up waiting.
+    ItemWaiter w;
+    CancelLink cancelLink;
+    if (cancel != NULL){
+      scond_init(&w.cond);
+      cancelLink.lock = &lock;
+      cancelLink.cond = &w.cond;
+      cancel->attach(&cancelLink);
+    }
+
+    smutex_lock(&lock);
+    // Suppliers change the item only under the lock, so from here
+    // on takeItem can only race other lock-free buyers.
+    status = takeItem(slot, budget, -1);
+    int result = status == ORDER_OK ? PURCHASE_BOUGHT : PURCHASE_REMOVED;
+    bool waited = false;
+    if (status == ORDER_BLOCKED && timeoutNs == 0){
+      result = PURCHASE_DECLINED;
+    } else if (status == ORDER_BLOCKED && cancel != NULL && cancel->isCancelled()){
+      result = PURCHASE_CANCELLED;
+    } else if (status == ORDER_BLOCKED){
+      w.budget = budget;
+      w.woken = false;
+      w.removed = false;
+      w.next = NULL;
+      if (cancel == NULL){
+        scond_init(&w.cond);
+      }
+      ItemWaiter** link = &slot->waiters;
+      while (*link != NULL){
+        link = &(*link)->next;
+      }
+      *link = &w;
+      noteItemWaiters(slot);
+      slot->waiting.fetch_add(1, std::memory_order_relaxed);
+      itemWaiterCount++;
+      stats.waits++;
+      waited = true;
+
+      result = -1;
+      while (result < 0){
+        while (!w.woken && result < 0){
+          if (cancel != NULL && cancel->isCancelled()){
+            result = PURCHASE_CANCELLED;
+          } else if (!purchase_wait(&w.cond, &lock, deadline) && !w.woken){
+            result = PURCHASE_TIMED_OUT;
+          }
+        }
+        if (result >= 0){
+          break;
+        }
+        stats.wakeups++;
+        if (w.removed){
+          result = PURCHASE_REMOVED;
+          break;
+        }
+        status = takeItem(slot, budget, -1);
+        if (status != ORDER_BLOCKED){
+          result = status == ORDER_OK ? PURCHASE_BOUGHT : PURCHASE_REMOVED;
+          break;
+        }
+        stats.spurious_wakeups++;
+        // We were counted against the stock when woken. Pass the
+        // wakeup on, or a waiter behind us that can buy the item
+        // would sleep until the item changes again.
+        w.woken = false;
+        wakeItemWaiters(slot);
+      }
+
+      for (link = &slot->waiters; *link != &w; link = &(*link)->next){
+      }
+      *link = w.next;
+      noteItemWaiters(slot);
+      slot->waiting.fetch_sub(1, std::memory_order_relaxed);
+      itemWaiterCount--;
+    }
+    unlockStore();
+
+    if (cancel != NULL){
+      cancel->detach(&cancelLink);
+    }
+    if (cancel != NULL || waited){
+      scond_destroy(&w.cond);
+    }
+    return countPurchase(result);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyItemFast --
+ *
+ *      The lock-free part of buyItemFor and buyItemAsync: try to buy
+ *      the item with a few CAS attempts.
+ *
+ * Results:
+ *      ORDER_OK if it was bought, ORDER_UNAVAILABLE if the store
+ *      does not carry it. Otherwise ORDER_BLOCKED with the item's
+ *      slot in *slot, and the caller has to take the store lock and
+ *      retry or wait.
+ *
+ * ------------------------------------------------------------------
+ */
+int EStore::
+buyItemFast(int item_id, double budget, ItemSlot** slot)
+{
+  if (item_id < 0){
+    return ORDER_UNAVAILABLE;
+  }
+  *slot = inventory.find(item_id);
+  if (*slot == NULL){
+    return ORDER_UNAVAILABLE;
+  }
+  int status = takeItem(*slot, budget, FAST_BUY_ATTEMPTS);
+  if (status == ORDER_OK){
+    fastBuys++;
+  }
+  if (status == ORDER_CONFLICT){
+    status = ORDER_BLOCKED;
+  }
+  return status;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyItemAsync --
+ *
+ *      buyItem for coroutines: co_await the result to buy the item.
+ *      Where buyItem would block, the coroutine is suspended
+ *      instead and the thread is free to run other tasks. It is
+ *      resumed, with the item already bought, by whoever makes the
+ *      item affordable, or, if the item is removed, without buying.
+ *
+ *      Only coarse mode supports it, as with buyItem. There is no
+ *      timeout or cancellation.
+ *
+ * Results:
+ *      An awaiter for the purchase.
+ *
+ * ------------------------------------------------------------------
+ */
+BuyItemAwaiter EStore::
+buyItemAsync(int item_id, double budget)
+{
+  assert(!fineModeEnabled());
+  ItemSlot* slot;
+  int status = buyItemFast(item_id, budget, &slot);
+  if (status != ORDER_BLOCKED){
+    int result = status == ORDER_OK ? PURCHASE_BOUGHT : PURCHASE_REMOVED;
+    return BuyItemAwaiter(this, NULL, budget, countPurchase(result));
+  }
+  return BuyItemAwaiter(this, slot, budget, -1);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * suspendBuyer --
+ *
+ *      Called from BuyItemAwaiter::await_suspend, after the fast
+ *      path failed. Retry the purchase under the store lock, and if
+ *      it is still blocked queue waiter, on behalf of the suspended
+ *      coroutine handle, on the item.
+ *
+ *      Once the lock is released a supplier may resume (and
+ *      destroy) the coroutine, so waiter must not be touched after
+ *      that.
+ *
+ * Results:
+ *      True if the coroutine stays suspended, false if the purchase
+ *      was settled (waiter->removed tells how) and it should carry
+ *      on.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::
+suspendBuyer(ItemSlot* slot, ItemWaiter* waiter, std::coroutine_handle<> handle)
+{
+  smutex_lock(&lock);
+  int status = takeItem(slot, waiter->budget, -1);
+  if (status != ORDER_BLOCKED){
+    smutex_unlock(&lock);
+    waiter->removed = status != ORDER_OK;
+    countPurchase(waiter->removed ? PURCHASE_REMOVED : PURCHASE_BOUGHT);
+    return false;
+  }
+  waiter->woken = false;
+  waiter->removed = false;
+  waiter->handle = handle;
+  waiter->next = NULL;
+  ItemWaiter** link = &slot->waiters;
+  while (*link != NULL){
+    link = &(*link)->next;
+  }
+  *link = waiter;
+  noteItemWaiters(slot);
+  slot->waiting.fetch_add(1, std::memory_order_relaxed);
+  itemWaiterCount++;
+  stats.async_waits++;
+  if (++asyncPending > stats.async_peak){
+    stats.async_peak = asyncPending;
+  }
+  smutex_unlock(&lock);
+  return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * wakeOrderWaiters --
+ *
+ *      Called with slot->lock held after the item changed in a way
+ *      that may let a blocked order go through (it was restocked,
+ *      got cheaper, or was removed, which makes the order give up).
+ *      Signal every order waiting on this item; each re-checks its
+ *      whole order itself. Orders that do not include the item are
+ *      not disturbed.
+ *
+ *      Lock order is item lock, then waiter lock.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+wakeOrderWaiters(ItemSlot* slot)
+{
+  const Item& item = slot->item;
+  if (item.valid && item.quantity == 0){
+    return;
+  }
+  for (OrderWaiterLink* l = slot->orderWaiters; l != NULL; l = l->next){
+    OrderWaiter* w = l->waiter;
+    smutex_lock(&w->lock);
+    if (!w->signaled){
+      w->signaled = true;
+      scond_signal(&w->cond, &w->lock);
+    }
+    smutex_unlock(&w->lock);
+  }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * wakeAllOrderWaiters --
+ *
+ *      Called after a store-wide price drop in fine mode. Signal
+ *      every blocked order, going through the list of blocked
+ *      orders; no item lock is taken. An order re-checks the
+ *      pricing after clearing its signal (see buyManyItemsFor), so
+ *      a drop that signals it between its check and its wait is
+ *      not lost.
+ *
+ *      Lock order is orderWaitersLock, then waiter lock.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+wakeAllOrderWaiters()
+{
+  // Not skipped when orderWaiterCount is 0: an order counts itself
+  // only after joining the list, and must not be missed.
+  smutex_lock(&orderWaitersLock);
+  for (OrderWaiter* w = orderWaiters; w != NULL; w = w->next){
+    smutex_lock(&w->lock);
+    if (!w->signaled){
+      w->signaled = true;
+      scond_signal(&w->cond, &w->lock);
+    }
+    smutex_unlock(&w->lock);
+  }
+  smutex_unlock(&orderWaitersLock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * addOrderWaiter --
+ *
+ *      Put w on the list of blocked orders.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+addOrderWaiter(OrderWaiter* w)
+{
+  smutex_lock(&orderWaitersLock);
+  w->next = orderWaiters;
+  if (orderWaiters != NULL){
+    orderWaiters->link = &w->next;
+  }
+  orderWaiters = w;
+  w->link = &orderWaiters;
+  smutex_unlock(&orderWaitersLock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * removeOrderWaiter --
+ *
+ *      Take w off the list of blocked orders.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+removeOrderWaiter(OrderWaiter* w)
+{
+  smutex_lock(&orderWaitersLock);
+  *w->link = w->next;
+  if (w->next != NULL){
+    w->next->link = w->link;
+  }
+  smutex_unlock(&orderWaitersLock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * lockItems --
+ *
+ *      Lock the count items in order, which must be sorted by item id.
+ *      Always taking item locks in increasing id order is what keeps
+ *      concurrent orders from deadlocking.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+lockItems(ItemSlot* const* order, int count)
+{
+  for (int i = 0; i < count; i++){
+    if (i == 0 || order[i] != order[i - 1]){
+      smutex_lock(&order[i]->lock);
+    }
+  }
+}
+
+void EStore::
+unlockItems(ItemSlot* const* order, int count)
 {
-  smutex_init(&lock);
-  scond_init(&available);
-  if (fineMode){
-    for (int i = 0; i < INVENTORY_SIZE; i++){
-      smutex_init(&locks[i]);
+  for (int i = count; i-- > 0; ){
+    if (i == 0 || order[i] != order[i - 1]){
+      smutex_unlock(&order[i]->lock);
     }
   }
 }
 
-EStore::
-~EStore()
+/*
+ * ------------------------------------------------------------------
+ * checkOrder --
+ *
+ *      Called with the locks of the count items in order held. order
+ *      must be sorted by item id; an item that appears n times needs n
+ *      units in stock.
+ *      Costs are computed with the given pricing snapshot.
+ *
+ *      If items is not NULL, items[i] is used as the value of
+ *      order[i]->item (a snapshot taken without the locks).
+ *
+ * Results:
+ *      ORDER_OK if the order can be bought now, ORDER_UNAVAILABLE if
+ *      the store does not carry one of the items, or ORDER_BLOCKED
+ *      if an item is out of stock or the order is over budget.
+ *      Unless the result is ORDER_UNAVAILABLE, the order's total
+ *      cost is stored in *cost if cost is not NULL.
+ *
+ * ------------------------------------------------------------------
+ */
+int EStore::
+checkOrder(ItemSlot* const* order, const Item* items, int count, double budget,
+           const Pricing& pricing, double* cost) const
 {
-  smutex_destroy(&lock);
-  scond_destroy(&available);
-  if (fineMode){
-    for (int i = 0; i < INVENTORY_SIZE; i++){
-      smutex_destroy(&locks[i]);
+  double sum = 0;
+  int status = ORDER_OK;
+  for (int i = 0; i < count; ){
+    const Item& item = items != NULL ? items[i] : order[i]->item;
+    int n = 1;
+    while (i + n < count && order[i + n] == order[i]){
+      n++;
     }
+    if (!item.valid){
+      return ORDER_UNAVAILABLE;
+    }
+    if (item.quantity < n){
+      status = ORDER_BLOCKED;
+    }
+    sum += n * itemCost(item, pricing);
+    i += n;
+  }
+  if (cost != NULL){
+    *cost = sum;
+  }
+  if (sum > budget){
+    status = ORDER_BLOCKED;
   }
+  return status;
 }
 
 /*
  * ------------------------------------------------------------------
- * buyItem --
+ * versionsUnchanged --
  *
- *      Attempt to buy the item from the store.
+ *      Check that no item in order has changed since versions were
+ *      read (duplicates in the sorted order are checked once).
  *
- *      An item can be bought if:
- *          - The store carries it.
- *          - The item is in stock.
- *          - The cost of the item plus the cost of shipping is no
- *            more than the budget.
+ * Results:
+ *      True if every item is still at its recorded version.
  *
- *      If the store *does not* carry this item, simply return and
- *      do nothing. Do not attempt to buy the item.
+ * ------------------------------------------------------------------
+ */
+bool EStore::
+versionsUnchanged(ItemSlot* const* order, const unsigned* versions, int count)
+{
+  for (int i = 0; i < count; i++){
+    if ((i == 0 || order[i] != order[i - 1])
+        && order[i]->version.version() != versions[i]){
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyOptimistic --
  *
- *      If the store *does* carry the item, but it is not in stock
- *      or its cost is over budget, block until both conditions are
- *      met (at which point the item should be bought) or the store
- *      removes the item from sale (at which point this method
- *      returns).
+ *      Try to settle an order (sorted, as in buyManyItems) with
+ *      optimistic concurrency control.
  *
- *      The overall cost of a purchase for a single item is defined
- *      as the current cost of the item times 1 - the store
- *      discount, plus the flat overall store shipping fee.
+ *      Read every item and the pricing without locks, noting their
+ *      versions, and check the order against that snapshot. If it
+ *      cannot be bought and nothing changed while we read it, the
+ *      snapshot was a consistent state of the store and we give up
+ *      without having taken a lock. If it can be bought, lock the
+ *      order's items, make sure none of them (nor the pricing) has
+ *      changed since the snapshot, and commit.
+ *
+ *      On a conflict, back off for a random, doubling number of
+ *      spins and start over, at most OCC_MAX_ATTEMPTS times.
  *
  * Results:
- *      None.
+ *      True if the order was bought or given up, with the outcome
+ *      (ORDER_OK, ORDER_UNAVAILABLE or ORDER_BLOCKED) in *status.
+ *      False if the caller must fall back to the locked path: too
+ *      many conflicts, or the order is blocked and wait is set.
  *
  * ------------------------------------------------------------------
  */
-void EStore::
-buyItem(int item_id, double budget)
+bool EStore::
+buyOptimistic(ItemSlot* const* order, int count, double budget, bool wait,
+              int* status)
 {
-    assert(!fineModeEnabled());
-    if (item_id < 0 || item_id > INVENTORY_SIZE){
-      return;
+  Item inlineItems[MAX_BUY_ITEM];
+  unsigned inlineVersions[MAX_BUY_ITEM];
+  vector<Item> heapItems;
+  vector<unsigned> heapVersions;
+  Item* items = inlineItems;
+  unsigned* versions = inlineVersions;
+  if (count > MAX_BUY_ITEM){
+    heapItems.resize(count);
+    heapVersions.resize(count);
+    items = heapItems.data();
+    versions = heapVersions.data();
+  }
+
+  int backoff = OCC_MIN_BACKOFF;
+  for (int attempt = 0; attempt < OCC_MAX_ATTEMPTS; attempt++){
+    if (attempt > 0){
+      occConflicts++;
+      for (long spins = sutil_random() % backoff; spins > 0; spins--){
+        cpu_relax();
+      }
+      backoff = min(backoff * 2, OCC_MAX_BACKOFF);
     }
-    smutex_lock(&lock);
-    Item item = inventory[item_id];
-    while (!item.valid|| item.quantity == 0 || item.price * (1 - item.discount) > budget){
-      scond_wait(&available, &lock);
+
+    for (int i = 0; i < count; i++){
+      if (i > 0 && order[i] == order[i - 1]){
+        items[i] = items[i - 1];
+        versions[i] = versions[i - 1];
+      } else {
+        items[i] = loadItem(order[i], &versions[i]);
+      }
     }
-    inventory[item_id].quantity--;
-    smutex_unlock(&lock);
+    unsigned pricingVersion;
+    Pricing pricing = readPricing(&pricingVersion);
+    int check = checkOrder(order, items, count, budget, pricing);
+
+    if (check != ORDER_OK){
+      if (!versionsUnchanged(order, versions, count)
+          || pricingLock.version() != pricingVersion){
+        continue;
+      }
+      if (check == ORDER_BLOCKED && wait){
+        return false;
+      }
+      occRejects++;
+      *status = check;
+      return true;
+    }
+
+    lockItems(order, count);
+    bool valid = versionsUnchanged(order, versions, count)
+                 && pricingLock.version() == pricingVersion;
+    if (valid){
+      for (int i = 0; i < count; i++){
+        Item item = beginItemUpdate(order[i]);
+        item.quantity--;
+        endItemUpdate(order[i], item);
+      }
+    }
+    unlockItems(order, count);
+    if (valid){
+      occCommits++;
+      *status = ORDER_OK;
+      return true;
+    }
+  }
+  occFallbacks++;
+  return false;
 }
 
 /*
@@ -127,6 +1217,31 @@ buyItem(int item_id, double budget)
  *      and store discount does not change while processing an
  *      order.
  *
+ *      The locks of all items in the order are taken in sorted id
+ *      order and held across the check and the purchase, so an
+ *      order is bought atomically.
+ *
+ *      The order is priced with one snapshot of the store-wide
+ *      pricing taken from the seqlock. Before buying, while still
+ *      holding the item locks, we make sure the pricing version has
+ *      not moved; if it has, the order is re-checked with the new
+ *      pricing. So the order is bought at a single (shipping,
+ *      discount) pair that was current when it committed, without
+ *      taking the store lock.
+ *
+ *      If waitForOrders is set, an order that is out of stock or
+ *      over budget is not given up: the caller registers an
+ *      OrderWaiter on each of its items, drops the item locks and
+ *      sleeps until one of them changes, then checks again. The
+ *      order is still given up if the store stops carrying one of
+ *      its items.
+ *
+ *      In optimistic mode the order is first tried without holding
+ *      the locks across the check (buyOptimistic); the locked path
+ *      above only runs if that keeps conflicting, or to wait.
+ *
+ *      See buyManyItemsFor, which does the work.
+ *
  * Results:
  *      None.
  *
@@ -134,32 +1249,184 @@ buyItem(int item_id, double budget)
  */
 void EStore::
 buyManyItems(vector<int>* item_ids, double budget)
+{
+    buyManyItems(item_ids->data(), item_ids->size(), budget);
+}
+
+void EStore::
+buyManyItems(const int* item_ids, int count, double budget)
+{
+    buyManyItemsFor(item_ids, count, budget,
+                    waitForOrders ? PURCHASE_NO_TIMEOUT : 0);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buyManyItemsFor --
+ *
+ *      buyManyItems, but wait for an order that cannot be bought yet
+ *      for up to timeoutNs nanoseconds (for as long as it takes if
+ *      negative, not at all if 0), whatever waitForOrders says, or
+ *      until cancel, if not NULL, is cancelled.
+ *
+ * Results:
+ *      The PurchaseResult: bought, removed, declined (timeoutNs was
+ *      0), timed out or cancelled.
+ *
+ * ------------------------------------------------------------------
+ */
+int EStore::
+buyManyItemsFor(const int* item_ids, int count, double budget, long timeoutNs,
+                CancelToken* cancel)
 {
     assert(fineModeEnabled());
-    double sum = 0;
-    for (size_t i = 0; i < item_ids->size(); i++){
-      int id = (*item_ids)[i];
-      smutex_lock(&locks[id]);
-      Item item = inventory[id];
-      if (!item.valid || !item.quantity){
-        smutex_unlock(&locks[id]);
-        return;
+    if (count <= 0){
+      return countPurchase(PURCHASE_BOUGHT);
+    }
+    uint64_t deadline = purchase_deadline(timeoutNs);
+    bool wait = timeoutNs != 0;
+
+    // Orders of up to MAX_BUY_ITEM items (i.e. every generated
+    // order) are handled without touching the heap.
+    int inlineIds[MAX_BUY_ITEM];
+    ItemSlot* inlineOrder[MAX_BUY_ITEM];
+    OrderWaiterLink inlineLinks[MAX_BUY_ITEM];
+    vector<int> heapIds;
+    vector<ItemSlot*> heapOrder;
+    vector<OrderWaiterLink> heapLinks;
+    int* ids = inlineIds;
+    ItemSlot** order = inlineOrder;
+    OrderWaiterLink* links = inlineLinks;
+    if (count > MAX_BUY_ITEM){
+      heapIds.resize(count);
+      heapOrder.resize(count);
+      heapLinks.resize(count);
+      ids = heapIds.data();
+      order = heapOrder.data();
+      links = heapLinks.data();
+    }
+
+    copy(item_ids, item_ids + count, ids);
+    sort(ids, ids + count);
+    if (ids[0] < 0){
+      return countPurchase(PURCHASE_REMOVED);
+    }
+    for (int i = 0; i < count; i++){
+      order[i] = inventory.find(ids[i]);
+      if (order[i] == NULL){
+        return countPurchase(PURCHASE_REMOVED);
+      }
+    }
+
+    int status;
+    if (optimistic && buyOptimistic(order, count, budget, wait, &status)){
+      if (status == ORDER_OK){
+        return countPurchase(PURCHASE_BOUGHT);
+      }
+      return countPurchase(status == ORDER_UNAVAILABLE ? PURCHASE_REMOVED
+                                                       : PURCHASE_DECLINED);
+    }
+
+    OrderWaiter w;
+    CancelLink cancelLink;
+    bool registered = false;
+    int result = -1;
+
+    lockItems(order, count);
+    while (true){
+      unsigned version;
+      Pricing pricing = readPricing(&version);
+      status = checkOrder(order, NULL, count, budget, pricing);
+      if (pricingLock.version() != version){
+        continue;
+      }
+      if (status != ORDER_BLOCKED || !wait){
+        break;
+      }
+      if (cancel != NULL && cancel->isCancelled()){
+        result = PURCHASE_CANCELLED;
+        break;
+      }
+
+      if (!registered){
+        smutex_init(&w.lock);
+        scond_init(&w.cond);
+        w.signaled = false;
+        addOrderWaiter(&w);
+        for (int i = 0; i < count; i++){
+          links[i].waiter = &w;
+          links[i].next = order[i]->orderWaiters;
+          order[i]->orderWaiters = &links[i];
+          order[i]->waiting.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (cancel != NULL){
+          cancelLink.lock = &w.lock;
+          cancelLink.cond = &w.cond;
+          cancel->attach(&cancelLink);
+        }
+        registered = true;
+        orderWaiterCount++;
+        orderWaits++;
+      } else {
+        orderSpuriousWakeups++;
+      }
+      smutex_lock(&w.lock);
+      w.signaled = false;
+      smutex_unlock(&w.lock);
+      // A store-wide price drop signals us without the item locks,
+      // so one since the check may have been cleared just now.
+      if (pricingLock.version() != version){
+        continue;
+      }
+      unlockItems(order, count);
+
+      smutex_lock(&w.lock);
+      while (!w.signaled && result < 0){
+        if (cancel != NULL && cancel->isCancelled()){
+          result = PURCHASE_CANCELLED;
+        } else if (!purchase_wait(&w.cond, &w.lock, deadline) && !w.signaled){
+          result = PURCHASE_TIMED_OUT;
+        }
       }
-      double amount = item.price * (1 - item.discount) + shipping_cost;
-      sum += amount;
-      if (sum > budget){
-        smutex_unlock(&locks[id]);
-        return;
+      smutex_unlock(&w.lock);
+
+      lockItems(order, count);
+      if (result >= 0){
+        break;
+      }
+      orderWakeups++;
+    }
+
+    if (result < 0 && status == ORDER_OK){
+      for (int i = 0; i < count; i++){
+        Item item = beginItemUpdate(order[i]);
+        item.quantity--;
+        endItemUpdate(order[i], item);
       }
-      smutex_unlock(&locks[id]);
+      result = PURCHASE_BOUGHT;
+    } else if (result < 0){
+      result = status == ORDER_UNAVAILABLE ? PURCHASE_REMOVED : PURCHASE_DECLINED;
     }
 
-    for (size_t i = 0; i < item_ids->size(); i++){
-      int id = (*item_ids)[i];
-      smutex_lock(&locks[id]);
-      inventory[id].quantity--;
-      smutex_unlock(&locks[id]);
+    if (registered){
+      for (int i = 0; i < count; i++){
+        OrderWaiterLink** link = &order[i]->orderWaiters;
+        while (*link != &links[i]){
+          link = &(*link)->next;
+        }
+        *link = links[i].next;
+        order[i]->waiting.fetch_sub(1, std::memory_order_relaxed);
+      }
+      if (cancel != NULL){
+        cancel->detach(&cancelLink);
+      }
+      removeOrderWaiter(&w);
+      orderWaiterCount--;
+      scond_destroy(&w.cond);
+      smutex_destroy(&w.lock);
     }
+    unlockItems(order, count);
+    return countPurchase(result);
 }
 
 /*
@@ -168,7 +1435,8 @@ buyManyItems(vector<int>* item_ids, double budget)
  *
  *      Add the item to the store with the specified quantity,
  *      price, and discount. If the store already carries an item
- *      with the specified id, do nothing.
+ *      with the specified id, or the store has been closed, do
+ *      nothing.
  *
  * Results:
  *      None.
@@ -179,29 +1447,29 @@ void EStore::
 addItem(int item_id, int quantity, double price, double discount)
 {
   
-  assert(item_id < INVENTORY_SIZE);
+  assert(item_id >= 0);
+  ItemSlot* slot = inventory.findOrCreate(item_id);
   if (fineMode){
-    smutex_lock(&locks[item_id]);
+    smutex_lock(&slot->lock);
   } else {
     smutex_lock(&lock); 
   }
-  Item item = inventory[item_id];
-  if (item.valid){
+  if (slot->item.valid || closed.load()){
     if (fineMode){
-      smutex_unlock(&locks[item_id]);
+      smutex_unlock(&slot->lock);
     } else {
       smutex_unlock(&lock);
     }
     return;
   }
+  Item item = beginItemUpdate(slot);
   item.valid = true;
   item.quantity = quantity;
   item.price = price;
   item.discount = discount;
-  inventory[item_id] = item;
-  scond_broadcast(&available, &lock);
+  endItemUpdate(slot, item);
   if (fineMode){
-    smutex_unlock(&locks[item_id]);
+    smutex_unlock(&slot->lock);
   } else {
     smutex_unlock(&lock);
   }
@@ -225,22 +1493,72 @@ addItem(int item_id, int quantity, double price, double discount)
 void EStore::
 removeItem(int item_id)
 {
-  assert(item_id < INVENTORY_SIZE);
+  ItemSlot* slot = inventory.find(item_id);
+  if (slot == NULL){
+    return;
+  }
   if (fineMode){
-    smutex_lock(&locks[item_id]);
+    smutex_lock(&slot->lock);
   } else {
     smutex_lock(&lock); 
   }
-  inventory[item_id].valid = false;
-  smutex_unlock(&lock);
+  Item item = beginItemUpdate(slot);
+  item.valid = false;
+  endItemUpdate(slot, item);
   if (fineMode){
-    smutex_unlock(&locks[item_id]);
+    wakeOrderWaiters(slot);
+    smutex_unlock(&slot->lock);
   } else {
-    smutex_unlock(&lock);
+    wakeItemWaiters(slot);
+    unlockStore();
   }
 
 }
 
+/*
+ * ------------------------------------------------------------------
+ * close --
+ *
+ *      Remove every item and refuse to add items from now on. Every
+ *      blocked buyItem or buyManyItems call is woken and returns
+ *      without buying, and later calls return immediately. Meant
+ *      for shutting the store down once the suppliers are done.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+close()
+{
+  closed.store(true);
+  inventory.forEach([this](ItemSlot* slot) {
+    removeItem(slot->id);
+  });
+}
+
+/*
+ * ------------------------------------------------------------------
+ * hasWaiters --
+ *
+ *      Check, without locking, whether any buyer or order is blocked
+ *      on the specified item. The answer may be stale by the time
+ *      it is used; it is meant for scheduling hints such as raising
+ *      the priority of a restock.
+ *
+ * Results:
+ *      True if somebody was waiting for the item.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::
+hasWaiters(int item_id)
+{
+  ItemSlot* slot = inventory.find(item_id);
+  return slot != NULL && slot->waiting.load(std::memory_order_relaxed) > 0;
+}
+
 /*
  * ------------------------------------------------------------------
  * addStock --
@@ -256,18 +1574,26 @@ removeItem(int item_id)
 void EStore::
 addStock(int item_id, int count)
 {
-  assert(item_id < INVENTORY_SIZE);
+  ItemSlot* slot = inventory.find(item_id);
+  if (slot == NULL){
+    return;
+  }
   if (fineMode){
-    smutex_lock(&locks[item_id]);
+    smutex_lock(&slot->lock);
   } else {
     smutex_lock(&lock); 
   }
-  inventory[item_id].quantity += count;
-  scond_broadcast(&available, &lock);
+  if (slot->item.valid){
+    Item item = beginItemUpdate(slot);
+    item.quantity += count;
+    endItemUpdate(slot, item);
+  }
   if (fineMode){
-    smutex_unlock(&locks[item_id]);
+    wakeOrderWaiters(slot);
+    smutex_unlock(&slot->lock);
   } else {
-    smutex_unlock(&lock);
+    wakeItemWaiters(slot);
+    unlockStore();
   }
 }
 
@@ -288,17 +1614,29 @@ addStock(int item_id, int count)
 void EStore::
 priceItem(int item_id, double price)
 {
-  assert(item_id < INVENTORY_SIZE);
+  ItemSlot* slot = inventory.find(item_id);
+  if (slot == NULL){
+    return;
+  }
   if (fineMode){
-    smutex_lock(&locks[item_id]);
+    smutex_lock(&slot->lock);
   } else {
     smutex_lock(&lock); 
   }
-  inventory[item_id].price = price;
+  Item item = beginItemUpdate(slot);
+  bool decreased = price < item.price;
+  item.price = price;
+  endItemUpdate(slot, item);
   if (fineMode){
-    smutex_unlock(&locks[item_id]);
+    if (decreased){
+      wakeOrderWaiters(slot);
+    }
+    smutex_unlock(&slot->lock);
   } else {
-    smutex_unlock(&lock);
+    if (decreased){
+      wakeItemWaiters(slot);
+    }
+    unlockStore();
   }
 }
 
@@ -319,17 +1657,29 @@ priceItem(int item_id, double price)
 void EStore::
 discountItem(int item_id, double discount)
 {
-  assert(item_id < INVENTORY_SIZE);
+  ItemSlot* slot = inventory.find(item_id);
+  if (slot == NULL){
+    return;
+  }
   if (fineMode){
-    smutex_lock(&locks[item_id]);
+    smutex_lock(&slot->lock);
   } else {
     smutex_lock(&lock); 
   }
-  inventory[item_id].discount = discount;
+  Item item = beginItemUpdate(slot);
+  bool increased = discount > item.discount;
+  item.discount = discount;
+  endItemUpdate(slot, item);
   if (fineMode){
-    smutex_unlock(&locks[item_id]);
+    if (increased){
+      wakeOrderWaiters(slot);
+    }
+    smutex_unlock(&slot->lock);
   } else {
-    smutex_unlock(&lock);
+    if (increased){
+      wakeItemWaiters(slot);
+    }
+    unlockStore();
   }
 }
 
@@ -349,12 +1699,17 @@ void EStore::
 setShippingCost(double cost)
 {
   smutex_lock(&lock);
-  bool decresed = cost < shipping_cost;
-  shipping_cost = cost;
+  bool decresed = cost < shipping_cost.load(std::memory_order_relaxed);
+  pricingLock.writeBegin();
+  shipping_cost.store(cost, std::memory_order_relaxed);
+  pricingLock.writeEnd();
   if (decresed){
-    scond_broadcast(&available, &lock);
+    wakeAllWaiters();
+  }
+  unlockStore();
+  if (decresed && fineMode && waitForOrders){
+    wakeAllOrderWaiters();
   }
-  smutex_unlock(&lock);
 }
 
 /*
@@ -373,12 +1728,313 @@ void EStore::
 setStoreDiscount(double discount)
 {
   smutex_lock(&lock);
-  bool increased = discount > store_discount;
-  store_discount = discount;
+  bool increased = discount > store_discount.load(std::memory_order_relaxed);
+  pricingLock.writeBegin();
+  store_discount.store(discount, std::memory_order_relaxed);
+  pricingLock.writeEnd();
   if (increased){
-    scond_broadcast(&available, &lock);
+    wakeAllWaiters();
+  }
+  unlockStore();
+  if (increased && fineMode && waitForOrders){
+    wakeAllOrderWaiters();
+  }
+}
+
+
+
+/*
+ * ------------------------------------------------------------------
+ * applyItemOp --
+ *
+ *      Apply a per-item supplier op to item, a value being written
+ *      between beginItemUpdate and endItemUpdate, with the effect
+ *      the corresponding method (addItem, removeItem, ...) has.
+ *
+ * Results:
+ *      True if waiters on the item should be woken, as that method
+ *      would.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::
+applyItemOp(Item* item, const SupplierOp& op)
+{
+  switch (op.type){
+    case ADD_ITEM:
+      if (!item->valid && !closed.load()){
+        item->valid = true;
+        item->quantity = op.count;
+        item->price = op.amount;
+        item->discount = op.discount;
+      }
+      return false;
+    case REMOVE_ITEM:
+      item->valid = false;
+      return true;
+    case ADD_STOCK:
+      if (item->valid){
+        item->quantity += op.count;
+      }
+      return true;
+    case CHANGE_ITEM_PRICE:
+    {
+      bool decreased = op.amount < item->price;
+      item->price = op.amount;
+      return decreased;
+    }
+    case CHANGE_ITEM_DISCOUNT:
+    {
+      bool increased = op.amount > item->discount;
+      item->discount = op.amount;
+      return increased;
+    }
+  }
+  assert(false);
+  return false;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * applyPricingOp --
+ *
+ *      Called with the store lock held. Apply a SET_SHIPPING_COST
+ *      or SET_STORE_DISCOUNT op, as setShippingCost or
+ *      setStoreDiscount would, but leave the wakeups to the caller.
+ *
+ * Results:
+ *      True if purchases got cheaper.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::
+applyPricingOp(const SupplierOp& op)
+{
+  bool cheaper;
+  pricingLock.writeBegin();
+  if (op.type == SET_SHIPPING_COST){
+    cheaper = op.amount < shipping_cost.load(std::memory_order_relaxed);
+    shipping_cost.store(op.amount, std::memory_order_relaxed);
+  } else {
+    assert(op.type == SET_STORE_DISCOUNT);
+    cheaper = op.amount > store_discount.load(std::memory_order_relaxed);
+    store_discount.store(op.amount, std::memory_order_relaxed);
+  }
+  pricingLock.writeEnd();
+  return cheaper;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * applyBatch --
+ *
+ *      Apply a batch of supplier requests, with the same effect as
+ *      calling the corresponding methods one by one, except that
+ *      requests for different items may be applied in any order.
+ *
+ *      The per-item ops are grouped by item, in batch order within
+ *      an item, and each group is written as one item update. A
+ *      group that leaves its item as it was is not written at all,
+ *      so it does not bump the item's version under optimistic
+ *      readers. In coarse mode the whole batch is applied under one
+ *      store lock acquisition; in fine mode each item is locked
+ *      once. Either way each item's waiters are woken at most once,
+ *      after its whole group, so they see only the group's net
+ *      effect (an item removed and added back within a batch does
+ *      not turn its waiters away). Shipping cost and store discount
+ *      changes come after all the item changes, in both modes; they
+ *      take the store lock once and wake the waiters at most once
+ *      for the batch.
+ *
+ *      ops holds at most MAX_BATCH_OPS requests, so the grouping is
+ *      done on the stack, without allocating.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+applyBatch(std::span<const SupplierOp> ops)
+{
+  assert(ops.size() <= MAX_BATCH_OPS);
+  // Indexes of the per-item ops, sorted by item and then by batch
+  // order, and of the pricing ops in batch order.
+  int itemOps[MAX_BATCH_OPS];
+  int pricingOps[MAX_BATCH_OPS];
+  size_t numItemOps = 0;
+  size_t numPricingOps = 0;
+  for (size_t i = 0; i < ops.size(); i++){
+    assert(ops[i].type >= 0 && ops[i].type < NUM_SUPPLIER_REQUEST_TYPES);
+    if (ops[i].type == SET_SHIPPING_COST || ops[i].type == SET_STORE_DISCOUNT){
+      pricingOps[numPricingOps++] = i;
+    } else {
+      itemOps[numItemOps++] = i;
+    }
+  }
+  sort(itemOps, itemOps + numItemOps,
+       [&ops](int a, int b){
+         return ops[a].item_id != ops[b].item_id ? ops[a].item_id < ops[b].item_id
+                                                 : a < b;
+       });
+
+  if (!fineMode){
+    smutex_lock(&lock);
+  }
+
+  for (size_t i = 0; i < numItemOps; ){
+    int item_id = ops[itemOps[i]].item_id;
+    size_t end = i;
+    bool adds = false;
+    for (; end < numItemOps && ops[itemOps[end]].item_id == item_id; end++){
+      adds |= ops[itemOps[end]].type == ADD_ITEM;
+    }
+    assert(!adds || item_id >= 0);
+    ItemSlot* slot = adds ? inventory.findOrCreate(item_id) : inventory.find(item_id);
+    if (slot != NULL){
+      if (fineMode){
+        smutex_lock(&slot->lock);
+      }
+      // Lock-free buyers may lower the quantity under us, but that
+      // never decides whether a group changes the item.
+      Item item = loadItem(slot, NULL);
+      Item before = item;
+      for (size_t j = i; j < end; j++){
+        applyItemOp(&item, ops[itemOps[j]]);
+      }
+      bool wake = false;
+      if (item.valid != before.valid || item.quantity != before.quantity
+          || item.price != before.price || item.discount != before.discount){
+        item = beginItemUpdate(slot);
+        for (size_t j = i; j < end; j++){
+          wake |= applyItemOp(&item, ops[itemOps[j]]);
+        }
+        endItemUpdate(slot, item);
+      }
+      if (fineMode){
+        if (wake){
+          wakeOrderWaiters(slot);
+        }
+        smutex_unlock(&slot->lock);
+      } else if (wake){
+        wakeItemWaiters(slot);
+      }
+    }
+    i = end;
+  }
+
+  if (fineMode){
+    if (numPricingOps == 0){
+      return;
+    }
+    smutex_lock(&lock);
+  }
+  bool cheaper = false;
+  for (size_t i = 0; i < numPricingOps; i++){
+    cheaper |= applyPricingOp(ops[pricingOps[i]]);
+  }
+  if (!fineMode){
+    if (cheaper){
+      wakeAllWaiters();
+    }
+    unlockStore();
+    return;
   }
   smutex_unlock(&lock);
+  if (cheaper && waitForOrders){
+    wakeAllOrderWaiters();
+  }
 }
 
+/*
+ * ------------------------------------------------------------------
+ * quote --
+ *
+ *      Price an order of the given items (an item that appears n
+ *      times counts n times) as buyManyItems would charge for it,
+ *      without buying anything and without taking any lock.
+ *
+ *      The items and the pricing are read through their seqlocks
+ *      and then every version is checked again (a double collect).
+ *      If none changed, all the values were current at once, at the
+ *      moment between the last read and the first check, so the
+ *      quote reflects a real state of the store. Otherwise the
+ *      collect is retried. Writers are never held up; a quote under
+ *      a steady stream of updates to its items may retry a few
+ *      times.
+ *
+ *      Works in every store mode.
+ *
+ * Results:
+ *      False if the store does not carry one of the items. Otherwise
+ *      true, with the order's total cost in result->total and
+ *      whether there were enough units in stock for it in
+ *      result->in_stock.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::
+quote(std::span<const int> item_ids, Quote* result) const
+{
+  int count = item_ids.size();
+  int inlineIds[MAX_BUY_ITEM];
+  ItemSlot* inlineOrder[MAX_BUY_ITEM];
+  Item inlineItems[MAX_BUY_ITEM];
+  unsigned inlineVersions[MAX_BUY_ITEM];
+  vector<int> heapIds;
+  vector<ItemSlot*> heapOrder;
+  vector<Item> heapItems;
+  vector<unsigned> heapVersions;
+  int* ids = inlineIds;
+  ItemSlot** order = inlineOrder;
+  Item* items = inlineItems;
+  unsigned* versions = inlineVersions;
+  if (count > MAX_BUY_ITEM){
+    heapIds.resize(count);
+    heapOrder.resize(count);
+    heapItems.resize(count);
+    heapVersions.resize(count);
+    ids = heapIds.data();
+    order = heapOrder.data();
+    items = heapItems.data();
+    versions = heapVersions.data();
+  }
+
+  copy(item_ids.begin(), item_ids.end(), ids);
+  sort(ids, ids + count);
+  if (count > 0 && ids[0] < 0){
+    return false;
+  }
+  for (int i = 0; i < count; i++){
+    order[i] = inventory.find(ids[i]);
+    if (order[i] == NULL){
+      return false;
+    }
+  }
+
+  Pricing pricing;
+  for (;;){
+    for (int i = 0; i < count; i++){
+      if (i > 0 && order[i] == order[i - 1]){
+        items[i] = items[i - 1];
+        versions[i] = versions[i - 1];
+      } else {
+        items[i] = loadItem(order[i], &versions[i]);
+      }
+    }
+    unsigned pricingVersion;
+    pricing = readPricing(&pricingVersion);
+    if (versionsUnchanged(order, versions, count)
+        && pricingLock.version() == pricingVersion){
+      break;
+    }
+    cpu_relax();
+  }
 
+  int status = checkOrder(order, items, count, HUGE_VAL, pricing, &result->total);
+  if (status == ORDER_UNAVAILABLE){
+    return false;
+  }
+  result->in_stock = status == ORDER_OK;
+  return true;
+}
@@ -1,8 +1,13 @@
 #pragma once
 
+#include <atomic>
+#include <coroutine>
+#include <span>
 #include <vector>
 #include "sthread.h"
 #include "Request.h"
+#include "SeqLock.h"
+#include "Inventory.h"
 
 /* 
  * ------------------------------------------------------------------
@@ -38,6 +43,215 @@ class Item {
 };
 
 
+/*
+ * ------------------------------------------------------------------
+ * ItemWaiter --
+ *
+ *      A customer blocked in buyItem, queued on the item it wants.
+ *      Each waiter has its own condition variable and records its
+ *      budget, so a change to one item wakes only the waiters on
+ *      that item that can now afford it.
+ *
+ *      A waiter with a handle is a coroutine suspended in
+ *      buyItemAsync rather than a blocked thread. It has no
+ *      condition variable: the supplier that makes the item
+ *      affordable buys it on the coroutine's behalf and resumes it.
+ *
+ * ------------------------------------------------------------------
+ */
+struct ItemWaiter {
+    double budget;
+    bool woken;
+    bool removed;
+    scond_t cond;
+    std::coroutine_handle<> handle;
+    ItemWaiter* next;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * OrderWaiter --
+ *
+ *      A customer blocked in buyManyItems. It is linked (through one
+ *      OrderWaiterLink per item) into the registry of every item in
+ *      its order, so a change to any of those items signals it and
+ *      changes to other items do not.
+ *
+ *      In fine mode there is no lock covering a whole order, so the
+ *      waiter sleeps on its own lock and condition variable.
+ *
+ *      While it waits, the waiter is also on the store's list of
+ *      blocked orders (next and link, the pointer that points at
+ *      it, under the store's orderWaitersLock), so a store-wide price drop can signal it
+ *      without looking at any item.
+ *
+ * ------------------------------------------------------------------
+ */
+struct OrderWaiter {
+    smutex_t lock;
+    scond_t cond;
+    bool signaled;
+    OrderWaiter* next;
+    OrderWaiter** link;
+};
+
+struct OrderWaiterLink {
+    OrderWaiter* waiter;
+    OrderWaiterLink* next;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * ItemSlot --
+ *
+ *      Everything the store keeps per item id: the item, the lock
+ *      that protects it in fine mode, and the queues of customers
+ *      waiting for it. Slots are created by the Inventory the first
+ *      time an item id is added and live as long as the store.
+ *
+ *      Slots are cache-line aligned so that updates to neighbouring
+ *      item ids never touch the same cache line.
+ *
+ *      Every change to item is bracketed by version.writeBegin and
+ *      writeEnd (EStore::beginItemUpdate/endItemUpdate), so the item
+ *      can also be read without the lock (EStore::loadItem), and a
+ *      purchase can be made with a CAS on version (EStore::takeItem).
+ *
+ *      waiting counts the buyers and orders queued on waiters and
+ *      orderWaiters. It is changed under the lock but may be read
+ *      without it, as a hint (EStore::hasWaiters).
+ *
+ *      While waiters is not empty, the slot is also on the store's
+ *      list of waited-on slots, through nextWaited and waitedLink
+ *      (the pointer that points at it), under the store lock.
+ *
+ * ------------------------------------------------------------------
+ */
+struct alignas(CACHE_LINE_SIZE) ItemSlot {
+    int id;
+    Item item;
+    SeqLock version;
+    smutex_t lock;
+    ItemWaiter* waiters;
+    OrderWaiterLink* orderWaiters;
+    std::atomic<int> waiting;
+    ItemSlot* nextWaited;
+    ItemSlot** waitedLink;
+};
+
+/*
+ * The store-wide pricing parameters, as one consistent pair.
+ */
+struct Pricing {
+    double shipping_cost;
+    double store_discount;
+};
+
+/*
+ * A price quote for an order (see EStore::quote): what buying it
+ * would cost, and whether there was enough stock to buy it.
+ */
+struct Quote {
+    double total;
+    bool in_stock;
+};
+
+/*
+ * How a purchase (buyItemFor, buyManyItemsFor, buyItemAsync) ended.
+ * REMOVED covers items the store never carried; DECLINED is an
+ * order that could not be bought right away when the caller would
+ * not wait for it.
+ */
+enum PurchaseResult {
+    PURCHASE_BOUGHT = 0,
+    PURCHASE_REMOVED,
+    PURCHASE_DECLINED,
+    PURCHASE_TIMED_OUT,
+    PURCHASE_CANCELLED,
+    NUM_PURCHASE_RESULTS
+};
+
+// Timeout for buyItemFor and buyManyItemsFor that never expires.
+#define PURCHASE_NO_TIMEOUT (-1)
+
+/*
+ * Counters for blocked purchases. A wakeup is spurious if the
+ * waiter finds it still cannot buy the item (or order) and has to
+ * wait again. The occ_ counters track optimistic orders and
+ * fast_buys the buyItem calls that never took the store lock.
+ * async_waits counts buyItemAsync calls that suspended, and
+ * async_peak the most that were suspended at once. purchases
+ * counts how every buy call ended, by PurchaseResult.
+ */
+struct EStoreStats {
+    long waits;
+    long wakeups;
+    long spurious_wakeups;
+    long order_waits;
+    long order_wakeups;
+    long order_spurious_wakeups;
+    long occ_commits;
+    long occ_rejects;
+    long occ_conflicts;
+    long occ_fallbacks;
+    long fast_buys;
+    long async_waits;
+    long async_peak;
+    long purchases[NUM_PURCHASE_RESULTS];
+};
+
+/*
+ * ------------------------------------------------------------------
+ * CancelToken --
+ *
+ *      Lets another thread call off purchases made with it. Once
+ *      cancelled, a purchase that is waiting gives up right away,
+ *      and one that would have to wait gives up instead; purchases
+ *      that can be made at once still go through. A token may be
+ *      shared by several purchases and stays cancelled.
+ *
+ *      A waiting purchase attaches a CancelLink naming the lock and
+ *      condition variable it sleeps on, so cancel() can wake it.
+ *      Lock order is the token's lock, then the waiter's lock, so
+ *      purchases attach and detach only while not holding the lock
+ *      they sleep on.
+ *
+ * ------------------------------------------------------------------
+ */
+struct CancelLink {
+    smutex_t* lock;
+    scond_t* cond;
+    CancelLink* next;
+};
+
+class CancelToken {
+    private:
+    std::atomic<bool> cancelled;
+    smutex_t lock;
+    CancelLink* links;
+
+    friend class EStore;
+    void attach(CancelLink* link);
+    void detach(CancelLink* link);
+
+    public:
+    CancelToken();
+    ~CancelToken();
+
+    void cancel();
+    bool isCancelled() const { return cancelled.load(); }
+};
+
+// Optimistic buyManyItems: attempts before falling back to locking
+// the whole order, and the range of the randomized backoff between
+// attempts, in cpu_relax spins.
+#define OCC_MAX_ATTEMPTS    8
+#define OCC_MIN_BACKOFF     16
+#define OCC_MAX_BACKOFF     1024
+
+// Lock-free attempts buyItem makes before taking the store lock.
+#define FAST_BUY_ATTEMPTS   4
+
 /* 
  * ------------------------------------------------------------------
  * EStore -- 
@@ -46,13 +260,24 @@ class Item {
  *      Customers and suppliers interact with the store through the
  *      methods of this class.
  *
- *      Items in the inventory are indexed by their item IDs.
+ *      Items in the inventory are indexed by their item IDs, which
+ *      can be any non-negative int. Each item lives in its own
+ *      ItemSlot together with its lock; the Inventory hash table
+ *      finds the slot for an id without locking.
  *
  *      The store discount should initially be set to 0.
  *      The shipping cost should initially be set to 3.
  *
  *      If fineMode is false, then this class functions strictly as
  *      a monitor. The buyItem method only functions in this mode.
+ *      Blocked buyers wait on per-item queues (waiters) rather than
+ *      on one store-wide condition variable.
+ *
+ *      buyItemAsync is buyItem for coroutines: co_await suspends
+ *      the coroutine instead of blocking the thread, and whoever
+ *      makes the item affordable (or removes it) resumes it, on
+ *      their own thread, once the store lock is released (see
+ *      unlockStore).
  *
  *      If fineMode is true, simultaneous requests for:
  *          - addItem,
@@ -62,23 +287,107 @@ class Item {
  *      that reference different item ids must process at the same
  *      time. The buyManyItems method only functions in this mode.
  *
+ *      If waitForOrders is true, buyManyItems blocks until the order
+ *      can be bought instead of giving up.
+ *
+ *      buyItemFor and buyManyItemsFor bound the wait with a timeout
+ *      and a CancelToken, and say how the purchase ended.
+ *
+ *      applyBatch applies up to MAX_BATCH_OPS supplier requests at
+ *      once, taking each lock and waking each item's waiters once
+ *      per batch.
+ *
+ *      quote prices an order without buying it or taking a lock,
+ *      from a consistent snapshot of its items and the pricing.
+ *
+ *      close() takes every item off the shelves for good, so no
+ *      buyer stays blocked once the suppliers have stopped.
+ *
+ *      If optimistic is true (fine mode only), buyManyItems first
+ *      tries optimistic concurrency control: it reads the order
+ *      without locks, validated by per-item versions, and locks the
+ *      items only to commit a purchase (see buyOptimistic).
+ *
+ *      shipping_cost and store_discount are written under lock but
+ *      published through pricingLock, a seqlock, so buyers can read
+ *      a consistent pair without taking lock (see readPricing).
+ *
  * ------------------------------------------------------------------
  */
+class BuyItemAwaiter;
+
 class EStore {
     private:
-    Item inventory[INVENTORY_SIZE];
+    Inventory inventory;
     const bool fineMode;
-  double shipping_cost;
-  double store_discount;
+    const bool waitForOrders;
+    const bool optimistic;
+  std::atomic<double> shipping_cost;
+  std::atomic<double> store_discount;
+  SeqLock pricingLock;
   smutex_t lock;
-  scond_t available;
-  smutex_t locks[INVENTORY_SIZE];
+  EStoreStats stats;
+  int itemWaiterCount;
+  ItemSlot* waitedSlots;
+  smutex_t orderWaitersLock;
+  OrderWaiter* orderWaiters;
+  std::atomic<int> orderWaiterCount;
+  std::atomic<long> orderWaits;
+  std::atomic<long> orderWakeups;
+  std::atomic<long> orderSpuriousWakeups;
+  std::atomic<bool> closed;
+  std::atomic<long> occCommits;
+  std::atomic<long> occRejects;
+  std::atomic<long> occConflicts;
+  std::atomic<long> occFallbacks;
+  std::atomic<long> fastBuys;
+  std::atomic<long> purchases[NUM_PURCHASE_RESULTS];
+  ItemWaiter* readyWaiters;
+  ItemWaiter** readyTail;
+  int asyncPending;
+
+  friend class BuyItemAwaiter;
+
+  Pricing readPricing(unsigned* version) const;
+  static double itemCost(const Item& item, const Pricing& pricing);
+  void wakeItemWaiters(ItemSlot* slot);
+  void noteItemWaiters(ItemSlot* slot);
+  void readyAsyncWaiter(ItemSlot* slot, ItemWaiter** link);
+  void unlockStore();
+  int countPurchase(int result);
+  int buyItemFast(int item_id, double budget, ItemSlot** slot);
+  bool suspendBuyer(ItemSlot* slot, ItemWaiter* waiter,
+                    std::coroutine_handle<> handle);
+  void wakeAllWaiters();
+  void wakeOrderWaiters(ItemSlot* slot);
+  void wakeAllOrderWaiters();
+  void addOrderWaiter(OrderWaiter* w);
+  void removeOrderWaiter(OrderWaiter* w);
+  void lockItems(ItemSlot* const* order, int count);
+  void unlockItems(ItemSlot* const* order, int count);
+  static Item loadItem(const ItemSlot* slot, unsigned* version);
+  static Item beginItemUpdate(ItemSlot* slot);
+  static void endItemUpdate(ItemSlot* slot, const Item& item);
+  int takeItem(ItemSlot* slot, double budget, int attempts);
+  int checkOrder(ItemSlot* const* order, const Item* items, int count,
+                 double budget, const Pricing& pricing,
+                 double* cost = NULL) const;
+  static bool versionsUnchanged(ItemSlot* const* order, const unsigned* versions,
+                                int count);
+  bool buyOptimistic(ItemSlot* const* order, int count, double budget,
+                     bool wait, int* status);
+  bool applyItemOp(Item* item, const SupplierOp& op);
+  bool applyPricingOp(const SupplierOp& op);
     public:
 
-    explicit EStore(bool enableFineMode);
+    explicit EStore(bool enableFineMode, bool enableWaitForOrders = false,
+                    bool enableOptimistic = false);
     ~EStore();
 
     void buyItem(int item_id, double budget);
+    int buyItemFor(int item_id, double budget, long timeoutNs,
+                   CancelToken* cancel = NULL);
+    BuyItemAwaiter buyItemAsync(int item_id, double budget);
     void addItem(int item_id, int quantity, double price, double discount);
     void removeItem(int item_id);
     void addStock(int item_id, int count);
@@ -86,9 +395,60 @@ class EStore {
     void discountItem(int item_id, double discount);
     void setShippingCost(double price);
     void setStoreDiscount(double discount);
+    void applyBatch(std::span<const SupplierOp> ops);
+    void close();
+    bool hasWaiters(int item_id);
 
     void buyManyItems(std::vector<int>* item_ids, double budget);
+    void buyManyItems(const int* item_ids, int count, double budget);
+    int buyManyItemsFor(const int* item_ids, int count, double budget,
+                        long timeoutNs, CancelToken* cancel = NULL);
+    bool quote(std::span<const int> item_ids, Quote* result) const;
 
     bool fineModeEnabled() const { return fineMode; }
+    bool waitForOrdersEnabled() const { return waitForOrders; }
+    bool optimisticEnabled() const { return optimistic; }
+    EStoreStats getStats();
 };
 
+
+/*
+ * ------------------------------------------------------------------
+ * BuyItemAwaiter --
+ *
+ *      What EStore::buyItemAsync returns. If the purchase could be
+ *      settled right away (bought, or the item is not carried) it
+ *      is ready and co_await does not suspend. Otherwise the
+ *      coroutine is queued on the item with waiter, which lives in
+ *      the coroutine frame for as long as it is suspended.
+ *
+ *      co_await yields a PurchaseResult: bought or removed.
+ *
+ * ------------------------------------------------------------------
+ */
+class BuyItemAwaiter {
+    private:
+    EStore* store;
+    ItemSlot* slot;
+    int result;
+    ItemWaiter waiter;
+
+    public:
+    BuyItemAwaiter(EStore* store, ItemSlot* slot, double budget, int result)
+        : store(store), slot(slot), result(result)
+    {
+        waiter.budget = budget;
+    }
+
+    bool await_ready() const { return slot == NULL; }
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        return store->suspendBuyer(slot, &waiter, handle);
+    }
+    int await_resume() const
+    {
+        if (slot == NULL)
+            return result;
+        return waiter.removed ? PURCHASE_REMOVED : PURCHASE_BOUGHT;
+    }
+};
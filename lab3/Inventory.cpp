@@ -0,0 +1,150 @@
+#include "Inventory.h"
+#include "EStore.h"
+
+Inventory::
+Inventory()
+{
+  for (int s = 0; s < INVENTORY_SHARDS; s++){
+    smutex_init(&shards[s].lock);
+    shards[s].table.store(newTable(INVENTORY_SHARD_MIN_CAPACITY));
+    shards[s].count = 0;
+  }
+}
+
+Inventory::
+~Inventory()
+{
+  for (int s = 0; s < INVENTORY_SHARDS; s++){
+    Table* t = shards[s].table.load();
+    for (size_t i = 0; i <= t->mask; i++){
+      ItemSlot* slot = t->cells[i].load();
+      if (slot != NULL){
+        smutex_destroy(&slot->lock);
+        delete slot;
+      }
+    }
+    shards[s].retired.push_back(t);
+    for (size_t i = 0; i < shards[s].retired.size(); i++){
+      delete[] shards[s].retired[i]->cells;
+      delete shards[s].retired[i];
+    }
+    smutex_destroy(&shards[s].lock);
+  }
+}
+
+/*
+ * Spread the bits of an item id. The top bits pick the shard and
+ * the low bits the starting cell within the shard's table.
+ */
+uint64_t Inventory::
+hash(int id)
+{
+  uint64_t h = (uint64_t) (uint32_t) id * 0x9E3779B97F4A7C15ull;
+  return h ^ (h >> 29);
+}
+
+Inventory::Table* Inventory::
+newTable(size_t capacity)
+{
+  Table* t = new Table;
+  t->mask = capacity - 1;
+  t->cells = new std::atomic<ItemSlot*>[capacity];
+  for (size_t i = 0; i < capacity; i++){
+    t->cells[i].store(NULL, std::memory_order_relaxed);
+  }
+  return t;
+}
+
+/*
+ * Put slot in the first free cell of its probe sequence. Caller
+ * holds the shard lock (or owns the table exclusively).
+ */
+void Inventory::
+insert(Table* table, ItemSlot* slot)
+{
+  size_t i = hash(slot->id) & table->mask;
+  while (table->cells[i].load(std::memory_order_relaxed) != NULL){
+    i = (i + 1) & table->mask;
+  }
+  table->cells[i].store(slot, std::memory_order_release);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * find --
+ *
+ *      Look up the slot for an item id without taking any lock.
+ *
+ * Results:
+ *      The slot, or NULL if no slot has been created for id.
+ *
+ * ------------------------------------------------------------------
+ */
+ItemSlot* Inventory::
+find(int id) const
+{
+  uint64_t h = hash(id);
+  const Shard& shard = shards[h >> (64 - INVENTORY_SHARD_BITS)];
+  Table* t = shard.table.load(std::memory_order_acquire);
+  for (size_t i = h & t->mask; ; i = (i + 1) & t->mask){
+    ItemSlot* slot = t->cells[i].load(std::memory_order_acquire);
+    if (slot == NULL || slot->id == id){
+      return slot;
+    }
+  }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * findOrCreate --
+ *
+ *      Look up the slot for an item id, creating an empty one (an
+ *      invalid item with no waiters) under the shard lock if there
+ *      is none yet. Grows the shard's table when it is half full.
+ *
+ * Results:
+ *      The slot.
+ *
+ * ------------------------------------------------------------------
+ */
+ItemSlot* Inventory::
+findOrCreate(int id)
+{
+  ItemSlot* slot = find(id);
+  if (slot != NULL){
+    return slot;
+  }
+
+  uint64_t h = hash(id);
+  Shard& shard = shards[h >> (64 - INVENTORY_SHARD_BITS)];
+  smutex_lock(&shard.lock);
+  slot = find(id);
+  if (slot == NULL){
+    Table* t = shard.table.load(std::memory_order_relaxed);
+    if (2 * (shard.count + 1) > t->mask + 1){
+      Table* bigger = newTable(2 * (t->mask + 1));
+      for (size_t i = 0; i <= t->mask; i++){
+        ItemSlot* old = t->cells[i].load(std::memory_order_relaxed);
+        if (old != NULL){
+          insert(bigger, old);
+        }
+      }
+      shard.table.store(bigger, std::memory_order_release);
+      shard.retired.push_back(t);
+      t = bigger;
+    }
+
+    slot = new ItemSlot();
+    slot->id = id;
+    slot->waiters = NULL;
+    slot->orderWaiters = NULL;
+    slot->nextWaited = NULL;
+    slot->waitedLink = NULL;
+    slot->waiting.store(0, std::memory_order_relaxed);
+    smutex_init(&slot->lock);
+    insert(t, slot);
+    shard.count++;
+  }
+  smutex_unlock(&shard.lock);
+  return slot;
+}
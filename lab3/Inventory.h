@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "sthread.h"
+
+struct ItemSlot;
+
+#define INVENTORY_SHARD_BITS        6
+#define INVENTORY_SHARDS            (1 << INVENTORY_SHARD_BITS)
+#define INVENTORY_SHARD_MIN_CAPACITY 16
+
+/*
+ * ------------------------------------------------------------------
+ * Inventory --
+ *
+ *      A concurrent hash table from item id to ItemSlot, split into
+ *      INVENTORY_SHARDS independent shards.
+ *
+ *      Each shard is an open-addressing table of slot pointers.
+ *      Readers (find) never lock: they load the shard's current
+ *      table and probe it. Creating a slot takes only the shard
+ *      lock. When a table gets half full, the writer builds a table
+ *      twice the size and publishes it with a single pointer store;
+ *      readers still probing the old table see every slot that
+ *      existed when they started. Old tables are kept until the
+ *      Inventory is destroyed, so no reader is ever left holding a
+ *      freed table.
+ *
+ *      Slots are never removed (a removed item is only marked
+ *      invalid), so an ItemSlot pointer stays valid for the life of
+ *      the Inventory.
+ *
+ *      The shard lock guards only the table: slot creation and
+ *      resizing. Changes to an item are guarded by the lock and
+ *      seqlock in its own ItemSlot (see EStore), which is finer
+ *      than a lock per shard. Two items in the same shard never
+ *      contend, and addItem, removeItem and addStock never take a
+ *      shard lock once the slot exists.
+ *
+ *      Memory: every slot is its own cache-line aligned ItemSlot,
+ *      128 bytes on x86-64, and each table holds 2 to 4 cells (8
+ *      bytes each) per slot. Retired tables are kept too. 10^7
+ *      item ids therefore take about 1.3GB of slots plus up to
+ *      about 0.6GB of tables, and the slots stay allocated after
+ *      their items are removed.
+ *
+ * ------------------------------------------------------------------
+ */
+class Inventory {
+    private:
+    struct Table {
+        size_t mask;
+        std::atomic<ItemSlot*>* cells;
+    };
+
+    struct alignas(CACHE_LINE_SIZE) Shard {
+        smutex_t lock;
+        std::atomic<Table*> table;
+        size_t count;
+        std::vector<Table*> retired;
+    };
+
+    Shard shards[INVENTORY_SHARDS];
+
+    static uint64_t hash(int id);
+    static Table* newTable(size_t capacity);
+    static void insert(Table* table, ItemSlot* slot);
+
+    public:
+    Inventory();
+    ~Inventory();
+
+    ItemSlot* find(int id) const;
+    ItemSlot* findOrCreate(int id);
+
+    /*
+     * Call f(slot) for every slot created so far.
+     */
+    template <class F>
+    void forEach(F f) const
+    {
+        for (int s = 0; s < INVENTORY_SHARDS; s++){
+            Table* t = shards[s].table.load(std::memory_order_acquire);
+            for (size_t i = 0; i <= t->mask; i++){
+                ItemSlot* slot = t->cells[i].load(std::memory_order_acquire);
+                if (slot != NULL){
+                    f(slot);
+                }
+            }
+        }
+    }
+};
@@ -0,0 +1,382 @@
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <sched.h>
+
+#include "sthread.h"
+#include "Log.h"
+
+#define LOG_OUT_SIZE    65536
+#define LOG_LINE_SIZE   1024
+
+/*
+ * One thread's records. Only the owning thread advances tail and only
+ * the writer advances head. Every buffer stays on the buffers list for
+ * good; a buffer whose thread has exited is also on the spare list,
+ * for the next thread that logs to take over.
+ */
+struct LogBuffer {
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> head;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail;
+    LogRecord records[LOG_RING_SIZE];
+    LogBuffer* next;
+    LogBuffer* nextSpare;
+};
+
+/*
+ * Gives the calling thread's buffer back to the spare list when the
+ * thread exits.
+ */
+struct LogBufferOwner {
+    LogBuffer* buffer;
+
+    LogBufferOwner() : buffer(NULL) { }
+    ~LogBufferOwner();
+};
+
+std::atomic<int> log_current_level(LOG_INFO);
+
+static smutex_t buffersLock = SMUTEX_INITIALIZER;
+static std::atomic<LogBuffer*> buffers(NULL);
+static LogBuffer* spareBuffers = NULL;
+static std::atomic<bool> writerRunning(false);
+static std::atomic<bool> writerStopping(false);
+static sthread_t writerThread;
+
+// The writer parks on writerCond while every buffer is empty, with
+// writerSleeping set so loggers know to wake it.
+static smutex_t writerLock = SMUTEX_INITIALIZER;
+static scond_t writerCond;
+static std::atomic<bool> writerSleeping(false);
+
+static thread_local LogBufferOwner myBuffer;
+
+/*
+ * ------------------------------------------------------------------
+ * log_format --
+ *
+ *      Format one record into out, which has room for size bytes.
+ *
+ * Results:
+ *      The number of bytes written, not counting the terminator.
+ *
+ * ------------------------------------------------------------------
+ */
+static size_t
+log_format(const LogRecord& rec, char* out, size_t size)
+{
+  size_t len = 0;
+  int arg = 0;
+  const char* p = rec.fmt;
+  char spec[32];
+
+  while (*p != '\0' && len + 1 < size){
+    if (*p != '%'){
+      out[len++] = *p++;
+      continue;
+    }
+    if (p[1] == '%'){
+      out[len++] = '%';
+      p += 2;
+      continue;
+    }
+
+    // Copy the conversion spec up to and including its letter.
+    size_t n = 0;
+    spec[n++] = *p++;
+    while (*p != '\0' && strchr("diucsfFeEgGxXL", *p) == NULL
+           && n < sizeof(spec) - 2){
+      spec[n++] = *p++;
+    }
+    if (*p == '\0'){
+      break;
+    }
+    char conv = *p++;
+    spec[n++] = conv;
+    spec[n] = '\0';
+
+    if (arg >= rec.nargs){
+      continue;
+    }
+    const LogArg& a = rec.args[arg++];
+    int w = 0;
+    switch (a.type){
+    case 'i':
+      w = snprintf(out + len, size - len, spec, a.i);
+      break;
+    case 'l':
+      w = snprintf(out + len, size - len, "%ld", a.l);
+      break;
+    case 'd':
+      w = snprintf(out + len, size - len, spec, a.d);
+      break;
+    case 's':
+      w = snprintf(out + len, size - len, "%s", a.s);
+      break;
+    case 'L':
+      for (int k = 0; k < a.i && arg < rec.nargs; k++){
+        int m = snprintf(out + len + w, size - len - w, "%d ",
+                         rec.args[arg++].i);
+        if (m > 0 && (size_t)(w + m) < size - len){
+          w += m;
+        }
+      }
+      break;
+    }
+    if (w > 0){
+      len += ((size_t)w < size - len) ? (size_t)w : size - len - 1;
+    }
+  }
+  out[len] = '\0';
+  return len;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * log_drain --
+ *
+ *      Format every record currently queued in every thread's buffer
+ *      and write them to stdout.
+ *
+ * Results:
+ *      True if any record was written.
+ *
+ * ------------------------------------------------------------------
+ */
+static bool
+log_drain(char* out)
+{
+  size_t used = 0;
+  bool any = false;
+
+  for (LogBuffer* b = buffers.load(std::memory_order_acquire); b != NULL;
+       b = b->next){
+    size_t head = b->head.load(std::memory_order_relaxed);
+    size_t tail = b->tail.load(std::memory_order_acquire);
+    while (head != tail){
+      if (LOG_OUT_SIZE - used < LOG_LINE_SIZE){
+        fwrite(out, 1, used, stdout);
+        used = 0;
+      }
+      used += log_format(b->records[head % LOG_RING_SIZE], out + used,
+                         LOG_LINE_SIZE);
+      head++;
+      b->head.store(head, std::memory_order_release);
+      any = true;
+    }
+  }
+  if (used > 0){
+    fwrite(out, 1, used, stdout);
+  }
+  if (any){
+    fflush(stdout);
+  }
+  return any;
+}
+
+/*
+ * True if some buffer holds records the writer has not taken yet.
+ */
+static bool
+log_pending()
+{
+  for (LogBuffer* b = buffers.load(std::memory_order_acquire); b != NULL;
+       b = b->next){
+    if (b->head.load(std::memory_order_relaxed)
+        != b->tail.load(std::memory_order_acquire)){
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Wake the writer if it is parked. Called after publishing records;
+ * the fence pairs with the one in log_writer, so either the writer
+ * sees the records before parking or we see it parked.
+ */
+static void
+log_wake_writer()
+{
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (writerSleeping.load(std::memory_order_relaxed)){
+    smutex_lock(&writerLock);
+    scond_signal(&writerCond, &writerLock);
+    smutex_unlock(&writerLock);
+  }
+}
+
+static void*
+log_writer(void*)
+{
+  char* out = new char[LOG_OUT_SIZE];
+
+  while (!writerStopping.load(std::memory_order_acquire)){
+    if (log_drain(out)){
+      continue;
+    }
+    smutex_lock(&writerLock);
+    writerSleeping.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (!writerStopping.load(std::memory_order_acquire) && !log_pending()){
+      scond_wait(&writerCond, &writerLock);
+    }
+    writerSleeping.store(false, std::memory_order_relaxed);
+    smutex_unlock(&writerLock);
+  }
+  log_drain(out);
+  delete[] out;
+  return NULL;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * ~LogBufferOwner --
+ *
+ *      Called at thread exit. Put the thread's buffer, if it has
+ *      one, on the spare list. Records still in it stay queued for
+ *      the writer, and the next owner appends after them.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+LogBufferOwner::
+~LogBufferOwner()
+{
+  if (buffer == NULL){
+    return;
+  }
+  smutex_lock(&buffersLock);
+  buffer->nextSpare = spareBuffers;
+  spareBuffers = buffer;
+  smutex_unlock(&buffersLock);
+  buffer = NULL;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * log_start --
+ *
+ *      Start the background writer. Until it runs, log_write prints
+ *      synchronously.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+log_start()
+{
+  if (writerRunning.load()){
+    return;
+  }
+  scond_init(&writerCond);
+  writerStopping.store(false);
+  writerRunning.store(true);
+  sthread_create_dedicated(&writerThread, log_writer, NULL);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * log_stop --
+ *
+ *      Write out everything logged so far and stop the writer. Every
+ *      thread that logs must have finished logging before this is
+ *      called.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+log_stop()
+{
+  if (!writerRunning.load()){
+    return;
+  }
+  smutex_lock(&writerLock);
+  writerStopping.store(true, std::memory_order_release);
+  scond_signal(&writerCond, &writerLock);
+  smutex_unlock(&writerLock);
+  sthread_join(writerThread);
+  writerRunning.store(false);
+  scond_destroy(&writerCond);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * log_set_level --
+ *
+ *      Change the verbosity. Takes effect for records logged after
+ *      the call.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+log_set_level(int level)
+{
+  log_current_level.store(level, std::memory_order_relaxed);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * log_submit --
+ *
+ *      Queue rec in the calling thread's buffer and wake the writer
+ *      if it is parked. On first use the thread takes over a spare
+ *      buffer, or registers a new one if there is none. Buffers are
+ *      never freed, so records left behind by a thread that exits
+ *      are still written. If the buffer is full the caller yields
+ *      until the writer catches up; nothing is dropped.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+log_submit(const LogRecord& rec)
+{
+  if (!writerRunning.load(std::memory_order_acquire)){
+    char line[LOG_LINE_SIZE];
+    size_t len = log_format(rec, line, sizeof(line));
+    fwrite(line, 1, len, stdout);
+    fflush(stdout);
+    return;
+  }
+
+  LogBuffer* b = myBuffer.buffer;
+  if (b == NULL){
+    smutex_lock(&buffersLock);
+    b = spareBuffers;
+    if (b != NULL){
+      spareBuffers = b->nextSpare;
+    } else {
+      b = new LogBuffer();
+      b->head.store(0);
+      b->tail.store(0);
+      b->next = buffers.load(std::memory_order_relaxed);
+      buffers.store(b, std::memory_order_release);
+    }
+    smutex_unlock(&buffersLock);
+    myBuffer.buffer = b;
+  }
+
+  size_t tail = b->tail.load(std::memory_order_relaxed);
+  while (tail - b->head.load(std::memory_order_acquire) >= LOG_RING_SIZE){
+    sched_yield();
+  }
+  LogRecord* slot = &b->records[tail % LOG_RING_SIZE];
+  slot->fmt = rec.fmt;
+  slot->nargs = rec.nargs;
+  memcpy(slot->args, rec.args, rec.nargs * sizeof(LogArg));
+  b->tail.store(tail + 1, std::memory_order_release);
+  log_wake_writer();
+}
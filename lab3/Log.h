@@ -0,0 +1,200 @@
+#pragma once
+
+#include <atomic>
+
+/*
+ * ------------------------------------------------------------------
+ * Asynchronous logging --
+ *
+ *      log_write(level, fmt, args...) does not format anything or
+ *      touch stdio. It copies the format pointer and the arguments
+ *      into a binary record in the calling thread's own ring buffer
+ *      (single producer, single consumer, no locks). One background
+ *      writer thread, started by log_start, drains every thread's
+ *      ring, formats the records and writes them to stdout in large
+ *      chunks. The writer sleeps while every ring is empty; the
+ *      first record logged while it sleeps wakes it.
+ *
+ *      When a thread exits, its ring is handed to the next thread
+ *      that starts logging, after the writer has drained what the
+ *      old thread left in it, so threads that come and go (e.g. one
+ *      generator per round) do not each cost a new ring.
+ *
+ *      fmt and any %s arguments must outlive the record, i.e. be
+ *      string literals. Supported conversions are the usual int,
+ *      long, double and string ones, plus %L, which prints a
+ *      LogList of ints separated by spaces.
+ *
+ *      Records from one thread come out in order; records from
+ *      different threads may be interleaved differently from the
+ *      order in which they were logged.
+ *
+ *      Records above the current level (log_set_level) are dropped
+ *      before anything is copied. If the writer is not running,
+ *      log_write formats and prints the record directly.
+ *
+ * ------------------------------------------------------------------
+ */
+
+enum LogLevel {
+    LOG_QUIET = 0,
+    LOG_INFO,
+    LOG_DEBUG
+};
+
+#define LOG_MAX_ARGS    12
+#define LOG_RING_SIZE   512
+
+/*
+ * A list of ints to print with %L. Only the pointer is stored by
+ * the caller; log_write copies the values into the record.
+ */
+struct LogList {
+    const int* values;
+    int count;
+
+    LogList(const int* v, int n) : values(v), count(n) { }
+};
+
+struct LogArg {
+    char type;
+    union {
+        int i;
+        long l;
+        double d;
+        const char* s;
+    };
+};
+
+struct LogRecord {
+    const char* fmt;
+    int nargs;
+    LogArg args[LOG_MAX_ARGS];
+};
+
+extern std::atomic<int> log_current_level;
+
+void log_start();
+void log_stop();
+void log_set_level(int level);
+void log_submit(const LogRecord& rec);
+
+static inline bool
+log_enabled(int level)
+{
+    return level <= log_current_level.load(std::memory_order_relaxed);
+}
+
+static inline void log_pack(LogRecord*) { }
+
+template <class... Rest>
+static inline void log_pack(LogRecord* rec, int v, Rest... rest);
+template <class... Rest>
+static inline void log_pack(LogRecord* rec, long v, Rest... rest);
+template <class... Rest>
+static inline void log_pack(LogRecord* rec, double v, Rest... rest);
+template <class... Rest>
+static inline void log_pack(LogRecord* rec, const char* v, Rest... rest);
+template <class... Rest>
+static inline void log_pack(LogRecord* rec, LogList v, Rest... rest);
+
+static inline LogArg*
+log_next_arg(LogRecord* rec, char type)
+{
+    if (rec->nargs >= LOG_MAX_ARGS){
+        return NULL;
+    }
+    LogArg* a = &rec->args[rec->nargs++];
+    a->type = type;
+    return a;
+}
+
+template <class... Rest>
+static inline void
+log_pack(LogRecord* rec, int v, Rest... rest)
+{
+    LogArg* a = log_next_arg(rec, 'i');
+    if (a != NULL){
+        a->i = v;
+    }
+    log_pack(rec, rest...);
+}
+
+template <class... Rest>
+static inline void
+log_pack(LogRecord* rec, long v, Rest... rest)
+{
+    LogArg* a = log_next_arg(rec, 'l');
+    if (a != NULL){
+        a->l = v;
+    }
+    log_pack(rec, rest...);
+}
+
+template <class... Rest>
+static inline void
+log_pack(LogRecord* rec, double v, Rest... rest)
+{
+    LogArg* a = log_next_arg(rec, 'd');
+    if (a != NULL){
+        a->d = v;
+    }
+    log_pack(rec, rest...);
+}
+
+template <class... Rest>
+static inline void
+log_pack(LogRecord* rec, const char* v, Rest... rest)
+{
+    LogArg* a = log_next_arg(rec, 's');
+    if (a != NULL){
+        a->s = v;
+    }
+    log_pack(rec, rest...);
+}
+
+/*
+ * A list is stored as a count followed by the values.
+ */
+template <class... Rest>
+static inline void
+log_pack(LogRecord* rec, LogList v, Rest... rest)
+{
+    int n = v.count;
+    if (n > LOG_MAX_ARGS - 1 - rec->nargs){
+        n = LOG_MAX_ARGS - 1 - rec->nargs;
+    }
+    LogArg* a = log_next_arg(rec, 'L');
+    if (a != NULL){
+        a->i = n;
+        for (int k = 0; k < n; k++){
+            log_next_arg(rec, 'i')->i = v.values[k];
+        }
+    }
+    log_pack(rec, rest...);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * log_write --
+ *
+ *      Log a printf-style message at the given level.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+template <class... Args>
+static inline void
+log_write(int level, const char* fmt, Args... args)
+{
+    if (!log_enabled(level)){
+        return;
+    }
+    LogRecord rec;
+    rec.fmt = fmt;
+    rec.nargs = 0;
+    log_pack(&rec, args...);
+    log_submit(rec);
+}
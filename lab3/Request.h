@@ -1,7 +1,8 @@
 #pragma once
 
-#include <vector>
+#include "RequestPool.h"
 
+// Default number of distinct item ids that generated requests use.
 #define INVENTORY_SIZE 100
 
 #define MAX_BUY_ITEM	    8
@@ -10,9 +11,11 @@
 #define MIN_BUDGET          5000
 #define MAX_PRICE	    1000000
 #define MAX_SHIPPING_COST   10000
+#define MAX_BATCH_OPS       64
 
 // Forward declaration. Do not remove!!
 class EStore;
+class CancelToken;
 
 enum SupplierRequestTypes {
     ADD_ITEM = 0,
@@ -25,7 +28,29 @@ enum SupplierRequestTypes {
     NUM_SUPPLIER_REQUEST_TYPES
 };
 
-struct AddItemReq
+/*
+ * One supplier request, of any SupplierRequestTypes type, as an
+ * element of a batch (see EStore::applyBatch). Fields a type does
+ * not use are ignored.
+ */
+struct SupplierOp
+{
+    int type;
+    int item_id;        // per-item types
+    int count;          // ADD_ITEM quantity, ADD_STOCK stock
+    double amount;      // price, discount or shipping cost
+    double discount;    // ADD_ITEM
+};
+
+// Request structs are allocated from per-type RequestPools (see
+// Pooled), so new and delete on them do not normally hit the heap.
+//
+// timeout_ns is how long a purchase may wait, in nanoseconds;
+// negative waits for as long as it takes (see EStore::buyItemFor).
+// cancel, if not NULL, ends the wait early when it is cancelled; it
+// must outlive the request.
+
+struct AddItemReq : Pooled<AddItemReq>
 {
     EStore* store;
 
@@ -35,14 +60,14 @@ struct AddItemReq
     double discount;
 };
 
-struct RemoveItemReq
+struct RemoveItemReq : Pooled<RemoveItemReq>
 {
     EStore* store;
 
     int item_id;
 };
 
-struct AddStockReq
+struct AddStockReq : Pooled<AddStockReq>
 {
     EStore* store;
 
@@ -50,7 +75,7 @@ struct AddStockReq
     int additional_stock;
 };
 
-struct ChangeItemPriceReq
+struct ChangeItemPriceReq : Pooled<ChangeItemPriceReq>
 {
     EStore* store;
 
@@ -58,7 +83,7 @@ struct ChangeItemPriceReq
     double new_price;
 };
 
-struct ChangeItemDiscountReq
+struct ChangeItemDiscountReq : Pooled<ChangeItemDiscountReq>
 {
     EStore* store;
 
@@ -66,33 +91,55 @@ struct ChangeItemDiscountReq
     double new_discount;
 };
 
-struct SetShippingCostReq
+struct SetShippingCostReq : Pooled<SetShippingCostReq>
 {
     EStore* store;
 
     double new_cost;
 };
 
-struct SetStoreDiscountReq
+struct SetStoreDiscountReq : Pooled<SetStoreDiscountReq>
 {
     EStore* store;
 
     double new_discount;
 };
 
-struct BuyItemReq
+// The ops of a SupplierBatchReq, too big to carry inline in a Task,
+// so pooled like the requests.
+struct SupplierOpBlock : Pooled<SupplierOpBlock>
+{
+    SupplierOp ops[MAX_BATCH_OPS];
+};
+
+// A batch of num_ops (at most MAX_BATCH_OPS) supplier requests. ops
+// is owned by the request; the handler deletes it.
+struct SupplierBatchReq : Pooled<SupplierBatchReq>
+{
+    EStore* store;
+
+    SupplierOpBlock* ops;
+    int num_ops;
+};
+
+struct BuyItemReq : Pooled<BuyItemReq>
 {
     EStore* store;
 
     int item_id;
     double budget;
+    long timeout_ns;
+    CancelToken* cancel;
 };
 
-struct BuyManyItemsReq
+struct BuyManyItemsReq : Pooled<BuyManyItemsReq>
 {
     EStore* store;
 
-    std::vector<int> item_ids;
+    int item_ids[MAX_BUY_ITEM];
+    int num_items;
     double budget;
+    long timeout_ns;
+    CancelToken* cancel;
 };
 
@@ -1,17 +1,17 @@
 #include <iostream>
 #include <cstdlib>
 #include <cassert>
-#include <set>
 
 #include "RequestHandlers.h"
 #include "RequestGenerator.h"
+#include "Bench.h"
 
 using namespace std;
 
 static int
-rand_id()
+rand_id(int range)
 {
-    return sutil_random() % INVENTORY_SIZE;
+    return sutil_random() % range;
 }
 
 static int
@@ -32,15 +32,58 @@ rand_discount()
     return ((double) sutil_random() / RAND_MAX);
 }
 
+/*
+ * Pick a supplier request type with probability proportional to its
+ * weight in mix.
+ */
 static int
-rand_request()
+rand_request(const int* mix)
 {
-    return sutil_random() % NUM_SUPPLIER_REQUEST_TYPES;
+    int total = 0;
+    for (int i = 0; i < NUM_SUPPLIER_REQUEST_TYPES; i++)
+        total += mix[i];
+    int r = sutil_random() % total;
+    for (int i = 0; i < NUM_SUPPLIER_REQUEST_TYPES; i++)
+    {
+        if (r < mix[i])
+            return i;
+        r -= mix[i];
+    }
+    return NUM_SUPPLIER_REQUEST_TYPES - 1;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * make_task --
+ *
+ *      Wrap a request in a Task. If inlineTask is set the request is
+ *      copied into the Task and handled by the typed handler H;
+ *      otherwise it is copied into a pooled heap object handled (and
+ *      deleted) by the void* handler F.
+ *
+ * Results:
+ *      The Task.
+ *
+ * ------------------------------------------------------------------
+ */
+template <class T, void (*H)(T*), void (*F)(void*)>
+static Task
+make_task(const T& req, bool inlineTask)
+{
+    if (inlineTask)
+        return Task::make<T, H>(req);
+
+    Task task;
+    task.handler = F;
+    task.arg = new T(req);
+    return task;
 }
 
 RequestGenerator::
-RequestGenerator(TaskQueue* queue)
-    : taskQueue(queue), taskCount(0)
+RequestGenerator(TaskSink* queue)
+    : taskQueue(queue), taskCount(0), itemIdRange(INVENTORY_SIZE), inlineTasks(true),
+      stream(0), interArrivalNs(0), timed(false), trace(NULL), traceSource(0),
+      asyncPurchases(false), patienceNs(PURCHASE_NO_TIMEOUT), cancel(NULL), stalls(0)
 {
 }
 
@@ -49,147 +92,485 @@ RequestGenerator::
 {
 }
 
+/*
+ * ------------------------------------------------------------------
+ * setItemIdRange --
+ *
+ *      Make generated requests use item ids in [0, range). The
+ *      default is INVENTORY_SIZE.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void RequestGenerator::
+setItemIdRange(int range)
+{
+    assert(range > 0);
+    itemIdRange = range;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * setInlineTasks --
+ *
+ *      Choose whether generated Tasks carry their request inline
+ *      (the default) or as a heap object behind a void* handler.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void RequestGenerator::
+setInlineTasks(bool enable)
+{
+    inlineTasks = enable;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * setStream --
+ *
+ *      Make enqueueTasks draw its requests from random stream n of
+ *      the master seed (see sutil_seed_thread), so the sequence of
+ *      requests is the same on every run with that seed. n must be
+ *      non-zero; by default the thread keeps whatever stream it has.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void RequestGenerator::
+setStream(uint64_t n)
+{
+    assert(n != 0);
+    stream = n;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * setInterArrival --
+ *
+ *      Sleep ns nanoseconds between enqueued tasks, to pace the
+ *      requests. The default, 0, enqueues as fast as the queue
+ *      accepts tasks; a bounded queue then holds the generator back
+ *      to the rate the workers keep up with.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void RequestGenerator::
+setInterArrival(long ns)
+{
+    assert(ns >= 0);
+    interArrivalNs = ns;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * setTimed --
+ *
+ *      Choose whether to stamp each Task with its enqueue time so
+ *      the worker that runs it can record its latency (see
+ *      bench_task_done).
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void RequestGenerator::
+setTimed(bool enable)
+{
+    timed = enable;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * setTrace --
+ *
+ *      Record every generated request in writer, as coming from
+ *      source (a TraceSource). writer may be shared with other
+ *      generators. NULL, the default, records nothing.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void RequestGenerator::
+setTrace(TraceWriter* writer, int source)
+{
+    assert(source >= 0 && source < NUM_TRACE_SOURCES);
+    trace = writer;
+    traceSource = source;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * setAsyncPurchases --
+ *
+ *      Choose whether BuyItem requests are handled by coroutines
+ *      (buy_item_async_handler), which suspend rather than block a
+ *      customer thread while the item cannot be bought. Coarse mode
+ *      only.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void RequestGenerator::
+setAsyncPurchases(bool enable)
+{
+    asyncPurchases = enable;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * setPatience --
+ *
+ *      Make generated purchases give up after waiting ns
+ *      nanoseconds. Negative, the default, waits for as long as it
+ *      takes.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void RequestGenerator::
+setPatience(long ns)
+{
+    patienceNs = ns;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * setCancelToken --
+ *
+ *      Give generated purchases token, so cancelling it ends their
+ *      waits. NULL, the default, leaves them uncancellable. The
+ *      token must outlive the generated tasks.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void RequestGenerator::
+setCancelToken(CancelToken* token)
+{
+    cancel = token;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * makeBuyItemTask --
+ *
+ *      Wrap a BuyItem request in a Task, with the blocking or the
+ *      coroutine handler (see setAsyncPurchases).
+ *
+ * Results:
+ *      The Task.
+ *
+ * ------------------------------------------------------------------
+ */
+Task RequestGenerator::
+makeBuyItemTask(const BuyItemReq& req)
+{
+    if (asyncPurchases)
+        return make_task<BuyItemReq,
+                         buy_item_async_handler, buy_item_async_handler>(req, inlineTasks);
+    return make_task<BuyItemReq,
+                     buy_item_handler, buy_item_handler>(req, inlineTasks);
+}
+
 void RequestGenerator::
 enqueueTasks(int maxTasks, EStore* store)
 {
     taskCount = 0;
+    if (stream != 0)
+        sutil_seed_thread(stream);
     while (taskCount < maxTasks || maxTasks < 0)
     {
-        taskQueue->enqueue(generateTask(store));
+        Task task = generateTask(store);
+        if (timed)
+            task.enqueued = bench_now_ns();
+        // A full queue holds us back until the workers catch up;
+        // count how often it does.
+        if (!taskQueue->tryEnqueue(task))
+        {
+            stalls++;
+            taskQueue->enqueue(task);
+        }
         taskCount++;
-        sthread_sleep(0, 100000000);
+        if (interArrivalNs > 0)
+            sthread_sleep(interArrivalNs / 1000000000, interArrivalNs % 1000000000);
     }
 }
 
+SupplierRequestGenerator::
+SupplierRequestGenerator(TaskSink* queue)
+    : RequestGenerator(queue), prioritizeRestocks(true), batchSize(1)
+{
+    for (int i = 0; i < NUM_SUPPLIER_REQUEST_TYPES; i++)
+        mix[i] = 1;
+}
+
 /*
  * ------------------------------------------------------------------
- * enqueueStops --
+ * setRequestMix --
  *
- *      Enqueue "num" stop requests (i.e. one per worker thread) into
- *      the task queue associated with this request generator.
+ *      Set the relative weight of each SupplierRequestTypes value
+ *      once the store has been filled. weights has
+ *      NUM_SUPPLIER_REQUEST_TYPES non-negative entries, at least one
+ *      of them positive. The default is a uniform mix.
  *
- *      Hint: Use the stop_handler function declared in
- *      RequestHandlers.h in conjunction with the task queue to
- *      create the stop requests.
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void SupplierRequestGenerator::
+setRequestMix(const int* weights)
+{
+    int total = 0;
+    for (int i = 0; i < NUM_SUPPLIER_REQUEST_TYPES; i++)
+    {
+        assert(weights[i] >= 0);
+        mix[i] = weights[i];
+        total += weights[i];
+    }
+    assert(total > 0);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * setPrioritizeRestocks --
+ *
+ *      Choose whether an ADD_STOCK request for an item that buyers
+ *      are blocked on is tagged TASK_PRIORITY_HIGH, so a TaskQueue
+ *      runs it ahead of the backlog of other supplier requests.
+ *      On by default.
  *
  * Results:
- *      Does not return a value.
+ *      None.
  *
  * ------------------------------------------------------------------
  */
-void RequestGenerator::
-enqueueStops(int num)
+void SupplierRequestGenerator::
+setPrioritizeRestocks(bool enable)
 {
-  taskCount = 0;
-  while (taskCount < num || num < 0){
-    Task task;
-    task.arg = NULL;
-    task.handler = stop_handler;
-    taskQueue->enqueue(task);
-    taskCount++;
-  }
+    prioritizeRestocks = enable;
 }
 
-SupplierRequestGenerator::
-SupplierRequestGenerator(TaskQueue* queue)
-    : RequestGenerator(queue)
-{ }
+/*
+ * ------------------------------------------------------------------
+ * setBatchSize --
+ *
+ *      Make each task a batch of n supplier requests, applied with
+ *      one EStore::applyBatch call, instead of a single request.
+ *      The requests are drawn exactly as they would be one by one.
+ *      n is at most MAX_BATCH_OPS. The default is 1 (no batching).
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void SupplierRequestGenerator::
+setBatchSize(int n)
+{
+    assert(n >= 1 && n <= MAX_BATCH_OPS);
+    batchSize = n;
+}
+
+/*
+ * Draw the index'th supplier request of the stream. The first 30
+ * are ADD_ITEM, to fill in the store.
+ */
+SupplierOp SupplierRequestGenerator::
+randomOp(int index)
+{
+    SupplierOp op = SupplierOp();
+
+    if (index < 30)
+        op.type = ADD_ITEM;
+    else
+        op.type = rand_request(mix);
+
+    switch (op.type)
+    {
+        case ADD_ITEM:
+            op.item_id = rand_id(itemIdRange);
+            op.amount  = rand_price(MAX_PRICE) + 1;
+            op.count   = rand_quantity();
+            break;
+        case REMOVE_ITEM:
+            op.item_id = rand_id(itemIdRange);
+            break;
+        case ADD_STOCK:
+            op.item_id = rand_id(itemIdRange);
+            op.count   = rand_quantity();
+            break;
+        case CHANGE_ITEM_PRICE:
+            op.item_id = rand_id(itemIdRange);
+            op.amount  = rand_price(MAX_PRICE);
+            break;
+        case CHANGE_ITEM_DISCOUNT:
+            op.item_id = rand_id(itemIdRange);
+            op.amount  = rand_discount();
+            break;
+        case SET_SHIPPING_COST:
+            op.amount  = rand_price(MAX_SHIPPING_COST);
+            break;
+        case SET_STORE_DISCOUNT:
+            op.amount  = rand_discount();
+            break;
+        default:
+            cerr << "Request type is undefined. Can not generate this type of requests." << endl;
+            assert(false);
+            break;
+    }
+    return op;
+}
 
+/*
+ * A task applying the next batchSize requests. Like a single
+ * restock, the batch is urgent if it restocks an item buyers are
+ * blocked on.
+ */
 Task SupplierRequestGenerator::
-generateTask(EStore* store)
+generateBatch(EStore* store)
 {
-    Task task;
+    SupplierBatchReq req = SupplierBatchReq();
+    req.store   = store;
+    req.ops     = new SupplierOpBlock;
+    req.num_ops = batchSize;
 
-    // generate a random number to determine the request_type
-    // first nine requests are ADD_ITEM to fill in the store
-    int request_type;
+    bool urgent = false;
+    for (int i = 0; i < batchSize; i++)
+    {
+        SupplierOp& op = req.ops->ops[i];
+        op = randomOp(taskCount * batchSize + i);
+        traceRequest(op);
+        if (prioritizeRestocks && op.type == ADD_STOCK && store->hasWaiters(op.item_id))
+            urgent = true;
+    }
 
-    if(taskCount < 30)
-        request_type = ADD_ITEM;
-    else
-        request_type = rand_request();
+    Task task = make_task<SupplierBatchReq,
+                          apply_batch_handler, apply_batch_handler>(req, inlineTasks);
+    if (urgent)
+        task.priority = TASK_PRIORITY_HIGH;
+    return task;
+}
+
+Task SupplierRequestGenerator::
+generateTask(EStore* store)
+{
+    if (batchSize > 1)
+        return generateBatch(store);
 
-    switch(request_type)
+    Task task;
+    SupplierOp op = randomOp(taskCount);
+
+    switch(op.type)
     {
         case ADD_ITEM:
         {
-            AddItemReq* req = new AddItemReq();
-            req->store = store;
-            req->item_id   = rand_id();
-            req->price     = rand_price(MAX_PRICE) + 1;
-            req->quantity  = rand_quantity();
+            AddItemReq req = AddItemReq();
+            req.store = store;
+            req.item_id   = op.item_id;
+            req.price     = op.amount;
+            req.quantity  = op.count;
 
-            task.handler = add_item_handler;
-            task.arg = req;
+            traceRequest(req);
+
+            task = make_task<AddItemReq,
+                             add_item_handler, add_item_handler>(req, inlineTasks);
             break;
         }
         case REMOVE_ITEM:
         {
-            RemoveItemReq* req = new RemoveItemReq();
-            req->store = store;
-            req->item_id   = rand_id();
+            RemoveItemReq req = RemoveItemReq();
+            req.store = store;
+            req.item_id   = op.item_id;
+
+            traceRequest(req);
 
-            task.handler = remove_item_handler;
-            task.arg = req;
+            task = make_task<RemoveItemReq,
+                             remove_item_handler, remove_item_handler>(req, inlineTasks);
             break;
         }
         case ADD_STOCK:
         {
-            AddStockReq* req = new AddStockReq();
-            req->store        = store;
-            req->item_id          = rand_id();
-            req->additional_stock = rand_quantity();
+            AddStockReq req = AddStockReq();
+            req.store        = store;
+            req.item_id          = op.item_id;
+            req.additional_stock = op.count;
 
-            task.handler = add_stock_handler;
-            task.arg = req;
+            traceRequest(req);
+
+            task = make_task<AddStockReq,
+                             add_stock_handler, add_stock_handler>(req, inlineTasks);
+            if (prioritizeRestocks && store->hasWaiters(req.item_id))
+                task.priority = TASK_PRIORITY_HIGH;
             break;
         }
         case CHANGE_ITEM_PRICE:
         {
-            ChangeItemPriceReq* req = new ChangeItemPriceReq();
-            req->store = store;
-            req->item_id    = rand_id();
-            req->new_price  = rand_price(MAX_PRICE);
+            ChangeItemPriceReq req = ChangeItemPriceReq();
+            req.store = store;
+            req.item_id    = op.item_id;
+            req.new_price  = op.amount;
+
+            traceRequest(req);
 
-            task.handler = change_item_price_handler;
-            task.arg = req;
+            task = make_task<ChangeItemPriceReq,
+                             change_item_price_handler, change_item_price_handler>(req, inlineTasks);
             break;
         }
         case CHANGE_ITEM_DISCOUNT:
         {
-            ChangeItemDiscountReq* req = new ChangeItemDiscountReq();
-            req->store = store;
-            req->item_id       = rand_id();
-            req->new_discount  = rand_discount();
+            ChangeItemDiscountReq req = ChangeItemDiscountReq();
+            req.store = store;
+            req.item_id       = op.item_id;
+            req.new_discount  = op.amount;
+
+            traceRequest(req);
 
-            task.handler = change_item_discount_handler;
-            task.arg = req;
+            task = make_task<ChangeItemDiscountReq,
+                             change_item_discount_handler, change_item_discount_handler>(req, inlineTasks);
             break;
         }
         case SET_SHIPPING_COST:
         {
-            SetShippingCostReq* req = new SetShippingCostReq();
-            req->store = store;
-            req->new_cost  = rand_price(MAX_SHIPPING_COST);
+            SetShippingCostReq req = SetShippingCostReq();
+            req.store = store;
+            req.new_cost  = op.amount;
 
-            task.handler = set_shipping_cost_handler;
-            task.arg = req;
+            traceRequest(req);
+
+            task = make_task<SetShippingCostReq,
+                             set_shipping_cost_handler, set_shipping_cost_handler>(req, inlineTasks);
             break;
         }
         case SET_STORE_DISCOUNT:
         {
-            SetStoreDiscountReq* req = new SetStoreDiscountReq();
-            req->store    = store;
-            req->new_discount = rand_discount();
+            SetStoreDiscountReq req = SetStoreDiscountReq();
+            req.store    = store;
+            req.new_discount = op.amount;
 
-            task.handler = set_store_discount_handler;
-            task.arg = req;
-            break;
-        }
-        default:
-        {
-            cerr << "Request type is undefined. Can not generate this type of requests." << endl;
-            assert(false);
+            traceRequest(req);
+
+            task = make_task<SetStoreDiscountReq,
+                             set_store_discount_handler, set_store_discount_handler>(req, inlineTasks);
             break;
         }
     } // !switch
@@ -198,7 +579,7 @@ generateTask(EStore* store)
 }
 
 CustomerRequestGenerator::
-CustomerRequestGenerator(TaskQueue* queue, bool inFineMode)
+CustomerRequestGenerator(TaskSink* queue, bool inFineMode)
     : RequestGenerator(queue), fineMode(inFineMode)
 { }
 
@@ -209,31 +590,221 @@ generateTask(EStore* store)
 
     if (!fineMode)
     {
-        BuyItemReq* req = new BuyItemReq();
-        req->store = store;
-        req->item_id   = rand_id();
-        req->budget    = rand_price(MAX_BUDGET) + MIN_BUDGET;
+        BuyItemReq req = BuyItemReq();
+        req.store = store;
+        req.item_id   = rand_id(itemIdRange);
+        req.budget    = rand_price(MAX_BUDGET) + MIN_BUDGET;
+        req.timeout_ns = patienceNs;
+        req.cancel = cancel;
+
+        traceRequest(req);
 
-        task.handler = buy_item_handler;
-        task.arg = req;
+        task = makeBuyItemTask(req);
     }
     else
     {
-        BuyManyItemsReq* req = new BuyManyItemsReq();
+        BuyManyItemsReq req = BuyManyItemsReq();
 
         int num_buy_item = (sutil_random() % MAX_BUY_ITEM) + 1;
 
-        set<int> order;
+        // Distinct ids, kept sorted, in the request's inline array.
+        req.num_items = 0;
         for(int i = 0; i < num_buy_item; i++)
-            order.insert(rand_id());
+        {
+            int id = rand_id(itemIdRange);
+            int pos = 0;
+            while (pos < req.num_items && req.item_ids[pos] < id)
+                pos++;
+            if (pos < req.num_items && req.item_ids[pos] == id)
+                continue;
+            for (int j = req.num_items; j > pos; j--)
+                req.item_ids[j] = req.item_ids[j - 1];
+            req.item_ids[pos] = id;
+            req.num_items++;
+        }
 
-        req->store = store;
-        req->item_ids.insert(req->item_ids.begin(), order.begin(), order.end());
-        req->budget = rand_price(MAX_BUDGET) + MIN_BUDGET;;
+        req.store = store;
+        req.budget = rand_price(MAX_BUDGET) + MIN_BUDGET;
+        req.timeout_ns = patienceNs;
+        req.cancel = cancel;
 
-        task.handler = buy_many_items_handler;
-        task.arg = req;
+        traceRequest(req);
+
+        task = make_task<BuyManyItemsReq,
+                         buy_many_items_handler, buy_many_items_handler>(req, inlineTasks);
     }
     return task;
 }
 
+
+ReplayRequestGenerator::
+ReplayRequestGenerator(TaskSink* queue, bool inFineMode,
+                       const std::vector<TraceRecord>* trace)
+    : RequestGenerator(queue), records(trace), fineMode(inFineMode),
+      paced(false), replayStart(0)
+{ }
+
+/*
+ * ------------------------------------------------------------------
+ * setPacing --
+ *
+ *      Enqueue each request no earlier than its recorded time after
+ *      start (a sthread_now_ns time). Generators replaying the
+ *      sources of one trace should share the same start.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void ReplayRequestGenerator::
+setPacing(uint64_t start)
+{
+    paced = true;
+    replayStart = start;
+}
+
+Task ReplayRequestGenerator::
+generateTask(EStore* store)
+{
+    const TraceRecord& rec = (*records)[taskCount];
+    if (paced)
+    {
+        uint64_t due = replayStart + rec.time_ns;
+        uint64_t now = sthread_now_ns();
+        if (due > now)
+            sthread_sleep((due - now) / 1000000000, (due - now) % 1000000000);
+    }
+
+    Task task;
+    switch (rec.type)
+    {
+        case ADD_ITEM:
+        {
+            AddItemReq req = AddItemReq();
+            req.store = store;
+            req.item_id  = rec.item_id;
+            req.quantity = rec.count;
+            req.price    = rec.amount;
+            req.discount = rec.discount;
+
+            task = make_task<AddItemReq,
+                             add_item_handler, add_item_handler>(req, inlineTasks);
+            break;
+        }
+        case REMOVE_ITEM:
+        {
+            RemoveItemReq req = RemoveItemReq();
+            req.store = store;
+            req.item_id = rec.item_id;
+
+            task = make_task<RemoveItemReq,
+                             remove_item_handler, remove_item_handler>(req, inlineTasks);
+            break;
+        }
+        case ADD_STOCK:
+        {
+            AddStockReq req = AddStockReq();
+            req.store = store;
+            req.item_id          = rec.item_id;
+            req.additional_stock = rec.count;
+
+            task = make_task<AddStockReq,
+                             add_stock_handler, add_stock_handler>(req, inlineTasks);
+            break;
+        }
+        case CHANGE_ITEM_PRICE:
+        {
+            ChangeItemPriceReq req = ChangeItemPriceReq();
+            req.store = store;
+            req.item_id   = rec.item_id;
+            req.new_price = rec.amount;
+
+            task = make_task<ChangeItemPriceReq,
+                             change_item_price_handler, change_item_price_handler>(req, inlineTasks);
+            break;
+        }
+        case CHANGE_ITEM_DISCOUNT:
+        {
+            ChangeItemDiscountReq req = ChangeItemDiscountReq();
+            req.store = store;
+            req.item_id      = rec.item_id;
+            req.new_discount = rec.amount;
+
+            task = make_task<ChangeItemDiscountReq,
+                             change_item_discount_handler, change_item_discount_handler>(req, inlineTasks);
+            break;
+        }
+        case SET_SHIPPING_COST:
+        {
+            SetShippingCostReq req = SetShippingCostReq();
+            req.store = store;
+            req.new_cost = rec.amount;
+
+            task = make_task<SetShippingCostReq,
+                             set_shipping_cost_handler, set_shipping_cost_handler>(req, inlineTasks);
+            break;
+        }
+        case SET_STORE_DISCOUNT:
+        {
+            SetStoreDiscountReq req = SetStoreDiscountReq();
+            req.store = store;
+            req.new_discount = rec.amount;
+
+            task = make_task<SetStoreDiscountReq,
+                             set_store_discount_handler, set_store_discount_handler>(req, inlineTasks);
+            break;
+        }
+        case TRACE_BUY_ITEM:
+        {
+            if (!fineMode)
+            {
+                BuyItemReq req = BuyItemReq();
+                req.store = store;
+                req.item_id = rec.item_id;
+                req.budget  = rec.amount;
+                req.timeout_ns = patienceNs;
+                req.cancel = cancel;
+
+                task = makeBuyItemTask(req);
+                break;
+            }
+            BuyManyItemsReq req = BuyManyItemsReq();
+            req.store = store;
+            req.item_ids[0] = rec.item_id;
+            req.num_items = 1;
+            req.budget = rec.amount;
+            req.timeout_ns = patienceNs;
+            req.cancel = cancel;
+
+            task = make_task<BuyManyItemsReq,
+                             buy_many_items_handler, buy_many_items_handler>(req, inlineTasks);
+            break;
+        }
+        case TRACE_BUY_MANY_ITEMS:
+        {
+            assert(fineMode);
+            BuyManyItemsReq req = BuyManyItemsReq();
+            req.store = store;
+            for (int i = 0; i < rec.num_items; i++)
+                req.item_ids[i] = rec.item_ids[i];
+            req.num_items = rec.num_items;
+            req.budget = rec.amount;
+            req.timeout_ns = patienceNs;
+            req.cancel = cancel;
+
+            task = make_task<BuyManyItemsReq,
+                             buy_many_items_handler, buy_many_items_handler>(req, inlineTasks);
+            break;
+        }
+        default:
+            assert(false);
+    }
+    if (trace != NULL)
+    {
+        TraceRecord copy = rec;
+        copy.source = traceSource;
+        trace->write(&copy);
+    }
+    return task;
+}
@@ -3,30 +3,78 @@
 #include "EStore.h"
 #include "TaskQueue.h"
 #include "Request.h"
+#include "Trace.h"
 
 class RequestGenerator {
     private:
-    TaskQueue* taskQueue;
+    TaskSink* taskQueue;
 
     protected:
     int taskCount;
+    int itemIdRange;
+    bool inlineTasks;
+    uint64_t stream;
+    long interArrivalNs;
+    bool timed;
+    TraceWriter* trace;
+    int traceSource;
+    bool asyncPurchases;
+    long patienceNs;
+    CancelToken* cancel;
+    long stalls;
 
     virtual Task generateTask(EStore* store) = 0;
+    Task makeBuyItemTask(const BuyItemReq& req);
+
+    /*
+     * Record req in the trace, if there is one.
+     */
+    template <class T>
+    void traceRequest(const T& req)
+    {
+        if (trace == NULL)
+            return;
+        TraceRecord rec;
+        trace_encode(req, &rec);
+        rec.source = traceSource;
+        trace->write(&rec);
+    }
 
     public:
-    RequestGenerator(TaskQueue* queue);
+    RequestGenerator(TaskSink* queue);
     ~RequestGenerator();
 
+    void setItemIdRange(int range);
+    void setInlineTasks(bool enable);
+    void setStream(uint64_t n);
+    void setInterArrival(long ns);
+    void setTimed(bool enable);
+    void setTrace(TraceWriter* writer, int source);
+    void setAsyncPurchases(bool enable);
+    void setPatience(long ns);
+    void setCancelToken(CancelToken* token);
     void enqueueTasks(int maxTasks, EStore* store);
-    void enqueueStops(int num);
+    long stallCount() const { return stalls; }
 };
 
 class SupplierRequestGenerator : public RequestGenerator {
+    private:
+    int mix[NUM_SUPPLIER_REQUEST_TYPES];
+    bool prioritizeRestocks;
+    int batchSize;
+
+    SupplierOp randomOp(int index);
+    Task generateBatch(EStore* store);
+
     protected:
     virtual Task generateTask(EStore* store);
 
     public:
-    SupplierRequestGenerator(TaskQueue* queue);
+    SupplierRequestGenerator(TaskSink* queue);
+
+    void setRequestMix(const int* weights);
+    void setPrioritizeRestocks(bool enable);
+    void setBatchSize(int n);
 };
 
 class CustomerRequestGenerator : public RequestGenerator {
@@ -37,6 +85,42 @@ class CustomerRequestGenerator : public RequestGenerator {
     virtual Task generateTask(EStore* store);
 
     public:
-    CustomerRequestGenerator(TaskQueue* queue, bool inFineMode);
+    CustomerRequestGenerator(TaskSink* queue, bool inFineMode);
+};
+
+/*
+ * ------------------------------------------------------------------
+ * ReplayRequestGenerator --
+ *
+ *      Generates the requests of a recorded trace (one source's
+ *      records, see trace_load) instead of random ones: call
+ *      enqueueTasks(recordCount(), store).
+ *
+ *      In fine mode a recorded BuyItem request is replayed as an
+ *      order of that one item, so a trace recorded in coarse mode
+ *      can be replayed in any mode. Orders of several items can
+ *      only be replayed in fine mode.
+ *
+ *      By default requests are enqueued as fast as the queue takes
+ *      them; setPacing replays them at their recorded times instead.
+ *
+ * ------------------------------------------------------------------
+ */
+class ReplayRequestGenerator : public RequestGenerator {
+    private:
+    const std::vector<TraceRecord>* records;
+    bool fineMode;
+    bool paced;
+    uint64_t replayStart;
+
+    protected:
+    virtual Task generateTask(EStore* store);
+
+    public:
+    ReplayRequestGenerator(TaskSink* queue, bool inFineMode,
+                           const std::vector<TraceRecord>* trace);
+
+    void setPacing(uint64_t start);
+    int recordCount() const { return records->size(); }
 };
 
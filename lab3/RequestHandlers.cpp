@@ -1,4 +1,49 @@
+#include <coroutine>
+#include <exception>
+
 #include "RequestHandlers.h"
+#include "Bench.h"
+
+/*
+ * ------------------------------------------------------------------
+ * DetachedCoroutine --
+ *
+ *      Return type of a fire-and-forget coroutine: it starts running
+ *      right away, nobody waits for its result, and its frame is
+ *      freed as soon as it finishes.
+ *
+ * ------------------------------------------------------------------
+ */
+struct DetachedCoroutine {
+    struct promise_type {
+        DetachedCoroutine get_return_object() { return DetachedCoroutine(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() { }
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+/*
+ * ------------------------------------------------------------------
+ * add_item_handler --
+ *
+ *      Handle an AddItemReq. The caller owns the request.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+add_item_handler(AddItemReq* rq)
+{
+  log_write(LOG_INFO, "Handling AddItemReq:item_id: %d quantity: %d rq->price: %f rq->discount: %f \n",
+            rq->item_id, rq->quantity, rq->price, rq->discount);
+  EStore* e = rq->store;
+  e->addItem(rq->item_id, rq->quantity, rq->price, rq->discount);
+}
+
 /*
  * ------------------------------------------------------------------
  * add_item_handler --
@@ -12,17 +57,34 @@
  *
  * ------------------------------------------------------------------
  */
-void 
+void
 add_item_handler(void *args)
 {
-  AddItemReq* rq = (AddItemReq*)args;
-  printf("Handling AddItemReq:item_id: %d quantity: %d rq->price: %f rq->discount: %f \n", rq->item_id, rq->quantity, rq->price, rq->discount);
-  fflush(stdout);
-  EStore* e = rq->store;
-  e->addItem(rq->item_id, rq->quantity, rq->price, rq->discount);
+  AddItemReq* rq = (AddItemReq *) args;
+  add_item_handler(rq);
   delete rq;
 }
 
+/*
+ * ------------------------------------------------------------------
+ * remove_item_handler --
+ *
+ *      Handle a RemoveItemReq. The caller owns the request.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+remove_item_handler(RemoveItemReq* rq)
+{
+  log_write(LOG_INFO, "Handling RemoveItemReq :item_id: %d\n",
+            rq->item_id);
+  EStore* es = rq->store;
+  es->removeItem(rq->item_id);
+}
+
 /*
  * ------------------------------------------------------------------
  * remove_item_handler --
@@ -36,17 +98,34 @@ add_item_handler(void *args)
  *
  * ------------------------------------------------------------------
  */
-void 
+void
 remove_item_handler(void *args)
 {
-  RemoveItemReq* rq = (RemoveItemReq*) args;
-  printf("Handling RemoveItemReq :item_id: %d\n", rq->item_id);
-  fflush(stdout);
-  EStore* es = rq->store;
-  es->removeItem(rq->item_id);
+  RemoveItemReq* rq = (RemoveItemReq *) args;
+  remove_item_handler(rq);
   delete rq;
 }
 
+/*
+ * ------------------------------------------------------------------
+ * add_stock_handler --
+ *
+ *      Handle an AddStockReq. The caller owns the request.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+add_stock_handler(AddStockReq* rq)
+{
+  log_write(LOG_INFO, "Handling AddStockReq:item_id: %d additional_stock: %d\n",
+            rq->item_id, rq->additional_stock);
+  EStore* es = rq->store;
+  es->addStock(rq->item_id, rq->additional_stock);
+}
+
 /*
  * ------------------------------------------------------------------
  * add_stock_handler --
@@ -60,17 +139,34 @@ remove_item_handler(void *args)
  *
  * ------------------------------------------------------------------
  */
-void 
+void
 add_stock_handler(void *args)
 {
-  AddStockReq *rq = (AddStockReq *) args;
-  printf("Handling AddStockReq:item_id: %d additional_stock: %d\n", rq->item_id, rq->additional_stock);
-  fflush(stdout);
-  EStore* es = rq->store;
-  es->addStock(rq->item_id, rq->additional_stock);
+  AddStockReq* rq = (AddStockReq *) args;
+  add_stock_handler(rq);
   delete rq;
 }
 
+/*
+ * ------------------------------------------------------------------
+ * change_item_price_handler --
+ *
+ *      Handle a ChangeItemPriceReq. The caller owns the request.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+change_item_price_handler(ChangeItemPriceReq* rq)
+{
+  log_write(LOG_INFO, "Handling ChangeItemPriceReq:item_id: %d new_price:%f\n",
+            rq->item_id, rq->new_price);
+  EStore* es = rq->store;
+  es->priceItem(rq->item_id, rq->new_price);
+}
+
 /*
  * ------------------------------------------------------------------
  * change_item_price_handler --
@@ -84,17 +180,34 @@ add_stock_handler(void *args)
  *
  * ------------------------------------------------------------------
  */
-void 
+void
 change_item_price_handler(void *args)
 {
   ChangeItemPriceReq* rq = (ChangeItemPriceReq *) args;
-  printf("Handling ChangeItemPriceReq:item_id: %d new_price:%f\n", rq->item_id, rq->new_price);
-  fflush(stdout);
-  EStore* es = rq->store;
-  es->priceItem(rq->item_id, rq->new_price);
+  change_item_price_handler(rq);
   delete rq;
 }
 
+/*
+ * ------------------------------------------------------------------
+ * change_item_discount_handler --
+ *
+ *      Handle a ChangeItemDiscountReq. The caller owns the request.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+change_item_discount_handler(ChangeItemDiscountReq* rq)
+{
+  log_write(LOG_INFO, "Handling ChangeItemDiscountReq:item_id: %d new_discount: %f\n",
+            rq->item_id, rq->new_discount);
+  EStore* es = rq->store;
+  es->discountItem(rq->item_id, rq->new_discount);
+}
+
 /*
  * ------------------------------------------------------------------
  * change_item_discount_handler --
@@ -108,17 +221,34 @@ change_item_price_handler(void *args)
  *
  * ------------------------------------------------------------------
  */
-void 
+void
 change_item_discount_handler(void *args)
 {
   ChangeItemDiscountReq* rq = (ChangeItemDiscountReq *) args;
-  printf("Handling ChangeItemDiscountReq:item_id: %d new_discount: %f\n", rq->item_id, rq->new_discount);
-  fflush(stdout);
-  EStore* es = rq->store;
-  es->discountItem(rq->item_id, rq->new_discount);
+  change_item_discount_handler(rq);
   delete rq;
 }
 
+/*
+ * ------------------------------------------------------------------
+ * set_shipping_cost_handler --
+ *
+ *      Handle a SetShippingCostReq. The caller owns the request.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+set_shipping_cost_handler(SetShippingCostReq* rq)
+{
+  log_write(LOG_INFO, "Handling SetShippingCostReq: new_cost %f\n",
+            rq->new_cost);
+  EStore* es = rq->store;
+  es->setShippingCost(rq->new_cost);
+}
+
 /*
  * ------------------------------------------------------------------
  * set_shipping_cost_handler --
@@ -132,17 +262,34 @@ change_item_discount_handler(void *args)
  *
  * ------------------------------------------------------------------
  */
-void 
+void
 set_shipping_cost_handler(void *args)
 {
-  SetShippingCostReq* rq = (SetShippingCostReq* ) args;
-  printf("Handling SetShippingCostReq: new_cost %f\n", rq->new_cost);
-  fflush(stdout);
-  EStore* es = rq->store;
-  es->setShippingCost(rq->new_cost);
+  SetShippingCostReq* rq = (SetShippingCostReq *) args;
+  set_shipping_cost_handler(rq);
   delete rq;
 }
 
+/*
+ * ------------------------------------------------------------------
+ * set_store_discount_handler --
+ *
+ *      Handle a SetStoreDiscountReq. The caller owns the request.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+set_store_discount_handler(SetStoreDiscountReq* rq)
+{
+  log_write(LOG_INFO, "Handling SetStoreDiscountReq: new_discount: %f\n",
+            rq->new_discount);
+  EStore* es = rq->store;
+  es->setStoreDiscount(rq->new_discount);
+}
+
 /*
  * ------------------------------------------------------------------
  * set_store_discount_handler --
@@ -160,13 +307,73 @@ void
 set_store_discount_handler(void *args)
 {
   SetStoreDiscountReq* rq = (SetStoreDiscountReq *) args;
-  printf("Handling SetStoreDiscountReq: new_discount: %f\n", rq->new_discount);
-  fflush(stdout);
+  set_store_discount_handler(rq);
+  delete rq;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * apply_batch_handler --
+ *
+ *      Handle a SupplierBatchReq. The caller owns the request, but
+ *      the ops block belongs to it and is deleted here.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+apply_batch_handler(SupplierBatchReq* rq)
+{
+  log_write(LOG_INFO, "Handling SupplierBatchReq: num_ops: %d\n",
+            rq->num_ops);
   EStore* es = rq->store;
-  es->setStoreDiscount(rq->new_discount);
+  es->applyBatch(std::span<const SupplierOp>(rq->ops->ops, rq->num_ops));
+  delete rq->ops;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * apply_batch_handler --
+ *
+ *      Handle a SupplierBatchReq.
+ *
+ *      Delete the request object when done.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+apply_batch_handler(void *args)
+{
+  SupplierBatchReq* rq = (SupplierBatchReq *) args;
+  apply_batch_handler(rq);
   delete rq;
 }
 
+/*
+ * ------------------------------------------------------------------
+ * buy_item_handler --
+ *
+ *      Handle a BuyItemReq. The caller owns the request.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+buy_item_handler(BuyItemReq* rq)
+{
+  log_write(LOG_INFO, "Handling BuyItemReq:item_id: %d, budget: %f\n",
+            rq->item_id, rq->budget);
+  EStore* es = rq->store;
+  es->buyItemFor(rq->item_id, rq->budget, rq->timeout_ns, rq->cancel);
+}
+
 /*
  * ------------------------------------------------------------------
  * buy_item_handler --
@@ -184,18 +391,60 @@ void
 buy_item_handler(void *args)
 {
   BuyItemReq* rq = (BuyItemReq *) args;
-  printf("Handling BuyItemReq:item_id: %d, budget: %f\n", rq->item_id, rq->budget);
-  fflush(stdout);
-  EStore* es = rq->store;
-  es->buyItem(rq->item_id, rq->budget);
+  buy_item_handler(rq);
   delete rq;
 }
 
 /*
  * ------------------------------------------------------------------
- * buy_many_items_handler --
+ * buy_item_coroutine --
  *
- *      Handle a BuyManyItemsReq.
+ *      Buy the item of req with buyItemAsync. The request is copied
+ *      into the coroutine frame, since the coroutine may outlive the
+ *      task that started it. It takes the task's latency timing
+ *      over, so a suspended purchase is timed until it completes.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static DetachedCoroutine
+buy_item_coroutine(BuyItemReq req)
+{
+  uint64_t enqueued = bench_defer();
+  co_await req.store->buyItemAsync(req.item_id, req.budget);
+  bench_finish(enqueued);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buy_item_async_handler --
+ *
+ *      Handle a BuyItemReq without blocking: if the item cannot be
+ *      bought yet, the purchase is suspended and completed later by
+ *      the supplier that makes it possible. timeout_ns and cancel
+ *      are ignored.
+ *      The caller owns the request.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+buy_item_async_handler(BuyItemReq* rq)
+{
+  log_write(LOG_INFO, "Handling BuyItemReq (async):item_id: %d, budget: %f\n",
+            rq->item_id, rq->budget);
+  buy_item_coroutine(*rq);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * buy_item_async_handler --
+ *
+ *      Handle a BuyItemReq without blocking.
  *
  *      Delete the request object when done.
  *
@@ -205,36 +454,57 @@ buy_item_handler(void *args)
  * ------------------------------------------------------------------
  */
 void
-buy_many_items_handler(void *args)
+buy_item_async_handler(void *args)
 {
-  BuyManyItemsReq* rq = (BuyManyItemsReq *) args;
-  printf("Handing BuyManyItemsReq : item_id: ");
-  for (size_t i = 0; i < rq->item_ids.size(); i++){
-    printf("%d ", rq->item_ids[i]);
-  }
-  printf("\n");
-  fflush(stdout);
-  EStore * es = rq->store;
-  es->buyManyItems(&rq->item_ids, rq->budget);
+  BuyItemReq* rq = (BuyItemReq *) args;
+  buy_item_async_handler(rq);
   delete rq;
 }
 
 /*
  * ------------------------------------------------------------------
- * stop_handler --
+ * buy_many_items_handler --
  *
- *      The thread should exit.
+ *      Handle a BuyManyItemsReq. The caller owns the request.
  *
  * Results:
  *      None.
  *
  * ------------------------------------------------------------------
  */
-void 
-stop_handler(void* args)
+void
+buy_many_items_handler(BuyManyItemsReq* rq)
 {
-  fflush(stdout);
-  printf("Thread Exit\n");
-  sthread_exit();
+  log_write(LOG_INFO, "Handing BuyManyItemsReq : item_id: %L\n",
+            LogList(rq->item_ids, rq->num_items));
+  EStore * es = rq->store;
+  // Without a timeout, wait only if the store waits for orders (see
+  // EStore::buyManyItems).
+  long timeoutNs = rq->timeout_ns;
+  if (timeoutNs < 0 && !es->waitForOrdersEnabled()){
+    timeoutNs = 0;
+  }
+  es->buyManyItemsFor(rq->item_ids, rq->num_items, rq->budget, timeoutNs,
+                      rq->cancel);
 }
 
+/*
+ * ------------------------------------------------------------------
+ * buy_many_items_handler --
+ *
+ *      Handle a BuyManyItemsReq.
+ *
+ *      Delete the request object when done.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+buy_many_items_handler(void *args)
+{
+  BuyManyItemsReq* rq = (BuyManyItemsReq *) args;
+  buy_many_items_handler(rq);
+  delete rq;
+}
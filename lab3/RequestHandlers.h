@@ -2,6 +2,7 @@
 #include "sthread.h"
 #include "Request.h"
 #include "EStore.h"
+#include "Log.h"
 #include <cstdio> 
 void add_item_handler(void *args);
 void remove_item_handler(void *args);
@@ -10,8 +11,23 @@ void change_item_price_handler(void *args);
 void change_item_discount_handler(void *args);
 void set_shipping_cost_handler(void *args);
 void set_store_discount_handler(void *args);
+void apply_batch_handler(void *args);
 
 void buy_item_handler(void *args);
+void buy_item_async_handler(void *args);
 void buy_many_items_handler(void *args);
 
-void stop_handler(void *args);
+// Typed handlers, for Tasks that carry the request inline (see
+// Task::make). Unlike the void* versions they do not delete it.
+void add_item_handler(AddItemReq* rq);
+void remove_item_handler(RemoveItemReq* rq);
+void add_stock_handler(AddStockReq* rq);
+void change_item_price_handler(ChangeItemPriceReq* rq);
+void change_item_discount_handler(ChangeItemDiscountReq* rq);
+void set_shipping_cost_handler(SetShippingCostReq* rq);
+void set_store_discount_handler(SetStoreDiscountReq* rq);
+void apply_batch_handler(SupplierBatchReq* rq);
+
+void buy_item_handler(BuyItemReq* rq);
+void buy_item_async_handler(BuyItemReq* rq);
+void buy_many_items_handler(BuyManyItemsReq* rq);
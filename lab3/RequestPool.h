@@ -0,0 +1,186 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+#include "sthread.h"
+
+#define REQUEST_POOL_BATCH 64
+
+/*
+ * ------------------------------------------------------------------
+ * RequestPool --
+ *
+ *      A free-list allocator for objects of type T, with a cache per
+ *      thread.
+ *
+ *      alloc and release only touch the calling thread's cache. When
+ *      a cache runs dry it takes a whole batch of free objects from
+ *      a shared depot; when it holds two batches it gives one back.
+ *      Batches hold REQUEST_POOL_BATCH objects, except that a cache
+ *      gives back whatever it has left, however little, when its
+ *      thread exits; the depot records each batch's length. Requests are allocated by the generator
+ *      threads and freed by the worker threads, so objects flow
+ *      from the workers' caches through the depot back to the
+ *      generators, and the depot lock is taken once per batch.
+ *
+ *      Memory is only obtained from the heap when the depot is empty
+ *      too, a slab of REQUEST_POOL_BATCH objects at a time, and is
+ *      never given back until the program exits. Once the pool has
+ *      grown to the number of requests in flight, allocation does
+ *      not touch the heap at all.
+ *
+ * ------------------------------------------------------------------
+ */
+template <class T>
+class RequestPool {
+    private:
+    union Node {
+        Node* next;
+        alignas(T) char object[sizeof(T)];
+    };
+
+    struct Batch {
+        Node* head;
+        int count;
+    };
+
+    struct Depot {
+        smutex_t lock;
+        std::vector<Batch> batches;
+        std::vector<Node*> slabs;
+
+        Depot() { smutex_init(&lock); }
+        ~Depot()
+        {
+            for (size_t i = 0; i < slabs.size(); i++){
+                delete[] slabs[i];
+            }
+            smutex_destroy(&lock);
+        }
+    };
+
+    struct Cache {
+        Node* head;
+        int count;
+
+        Cache() : head(NULL), count(0) { }
+        ~Cache()
+        {
+            while (count > 0){
+                giveBatch(this);
+            }
+        }
+    };
+
+    static Depot& depot()
+    {
+        static Depot d;
+        return d;
+    }
+
+    static Cache& cache()
+    {
+        static thread_local Cache c;
+        return c;
+    }
+
+    /*
+     * Refill an empty cache with one batch from the depot, or with
+     * a new slab if the depot is empty.
+     */
+    static void takeBatch(Cache* c)
+    {
+        Depot& d = depot();
+        smutex_lock(&d.lock);
+        if (!d.batches.empty()){
+            Batch b = d.batches.back();
+            d.batches.pop_back();
+            smutex_unlock(&d.lock);
+            c->head = b.head;
+            c->count = b.count;
+            return;
+        }
+        Node* slab = new Node[REQUEST_POOL_BATCH];
+        d.slabs.push_back(slab);
+        smutex_unlock(&d.lock);
+
+        for (int i = 0; i < REQUEST_POOL_BATCH - 1; i++){
+            slab[i].next = &slab[i + 1];
+        }
+        slab[REQUEST_POOL_BATCH - 1].next = NULL;
+        c->head = slab;
+        c->count = REQUEST_POOL_BATCH;
+    }
+
+    /*
+     * Move up to one batch of objects from the cache to the depot.
+     */
+    static void giveBatch(Cache* c)
+    {
+        Node* batch = c->head;
+        Node* last = batch;
+        int n = 1;
+        while (n < REQUEST_POOL_BATCH && last->next != NULL){
+            last = last->next;
+            n++;
+        }
+        c->head = last->next;
+        c->count -= n;
+        last->next = NULL;
+
+        Depot& d = depot();
+        smutex_lock(&d.lock);
+        d.batches.push_back(Batch{batch, n});
+        smutex_unlock(&d.lock);
+    }
+
+    public:
+    static void* alloc()
+    {
+        Cache& c = cache();
+        if (c.head == NULL){
+            takeBatch(&c);
+        }
+        Node* n = c.head;
+        c.head = n->next;
+        c.count--;
+        return n;
+    }
+
+    static void release(void* p)
+    {
+        if (p == NULL){
+            return;
+        }
+        Cache& c = cache();
+        Node* n = (Node*) p;
+        n->next = c.head;
+        c.head = n;
+        c.count++;
+        if (c.count >= 2 * REQUEST_POOL_BATCH){
+            giveBatch(&c);
+        }
+    }
+};
+
+/*
+ * Base class that makes new and delete of T use RequestPool<T>.
+ */
+template <class T>
+struct Pooled {
+    static void* operator new(size_t size)
+    {
+        return size == sizeof(T) ? RequestPool<T>::alloc() : ::operator new(size);
+    }
+
+    static void operator delete(void* p, size_t size)
+    {
+        if (size == sizeof(T)){
+            RequestPool<T>::release(p);
+        } else {
+            ::operator delete(p);
+        }
+    }
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+
+/*
+ * ------------------------------------------------------------------
+ * SeqLock --
+ *
+ *      A sequence lock: readers never block writers and never write
+ *      shared memory themselves.
+ *
+ *      A writer makes the sequence odd, updates the protected data
+ *      and makes it even again. A reader notes the (even) sequence
+ *      with readBegin, copies the data, and uses readRetry to check
+ *      that no writer ran in the meantime; if one did it copies
+ *      again. The protected fields must be accessed atomically (with
+ *      relaxed ordering) so that a copy racing a writer is merely
+ *      stale, not undefined.
+ *
+ *      writeBegin spins while another writer is in progress, so
+ *      writers exclude each other, but the spin is only meant to
+ *      cover short tryWriteBegin sections: writers that may take
+ *      longer should be serialized by a lock. tryWriteBegin(v)
+ *      becomes the writer only if the sequence is still v, i.e.
+ *      nothing was written since a reader saw v, which allows a
+ *      lock-free read-check-write.
+ *
+ * ------------------------------------------------------------------
+ */
+class SeqLock {
+    private:
+    std::atomic<unsigned> seq;
+
+    public:
+    SeqLock() : seq(0) { }
+
+    unsigned readBegin() const
+    {
+        unsigned s;
+        while ((s = seq.load(std::memory_order_acquire)) & 1){
+        }
+        return s;
+    }
+
+    bool readRetry(unsigned start) const
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return seq.load(std::memory_order_relaxed) != start;
+    }
+
+    void writeBegin()
+    {
+        unsigned s = seq.load(std::memory_order_relaxed);
+        while ((s & 1) || !seq.compare_exchange_weak(s, s + 1,
+                                                     std::memory_order_acquire,
+                                                     std::memory_order_relaxed)){
+            s = seq.load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    bool tryWriteBegin(unsigned start)
+    {
+        if (!seq.compare_exchange_strong(start, start + 1, std::memory_order_acquire,
+                                         std::memory_order_relaxed)){
+            return false;
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        return true;
+    }
+
+    void writeEnd()
+    {
+        seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    unsigned version() const { return seq.load(std::memory_order_acquire); }
+};
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+
+typedef void (*handler_t) (void *); 
+
+// Big enough for the largest request, BuyManyItemsReq.
+#define TASK_INLINE_SIZE 72
+
+/*
+ * Priority classes, most urgent first. A TaskQueue keeps one lane
+ * per class; other TaskSinks ignore the priority.
+ */
+enum TaskPriority {
+    TASK_PRIORITY_HIGH = 0,
+    TASK_PRIORITY_NORMAL,
+    TASK_NUM_PRIORITIES
+};
+
+/*
+ * ------------------------------------------------------------------
+ * Task --
+ *
+ *      A unit of work for a worker thread.
+ *
+ *      The original form is {handler, arg}: run calls handler(arg),
+ *      and arg usually points at a heap-allocated request that the
+ *      handler deletes.
+ *
+ *      A Task can instead carry its request by value, in payload.
+ *      Task::make<T, H>(req) copies req (up to TASK_INLINE_SIZE
+ *      bytes, trivially copyable) into the task and arranges for run
+ *      to call H(T*) on the copy, so there is no allocation and no
+ *      untyped pointer to chase.
+ *
+ *      enqueued is the time (bench_now_ns) at which the producer
+ *      handed the task over, or 0 if the task is not being timed.
+ *      priority is a TaskPriority; producers raise it for tasks that
+ *      should overtake the rest.
+ *
+ * ------------------------------------------------------------------
+ */
+struct Task {
+    handler_t handler;
+    void* arg;
+    void (*invoke)(Task* task);
+    uint64_t enqueued;
+    unsigned char priority;
+    alignas(8) unsigned char payload[TASK_INLINE_SIZE];
+
+    Task()
+        : handler(NULL), arg(NULL), invoke(NULL), enqueued(0),
+          priority(TASK_PRIORITY_NORMAL) { }
+
+    template <class T, void (*H)(T*)>
+    static Task make(const T& req)
+    {
+        static_assert(sizeof(T) <= TASK_INLINE_SIZE, "request too big for a Task");
+        static_assert(alignof(T) <= 8, "request alignment too big for a Task");
+        static_assert(std::is_trivially_copyable<T>::value,
+                      "inline requests must be trivially copyable");
+        Task task;
+        ::new (task.payload) T(req);
+        task.invoke = invokeInline<T, H>;
+        return task;
+    }
+
+    void run()
+    {
+        if (invoke != NULL){
+            invoke(this);
+        } else {
+            handler(arg);
+        }
+    }
+
+    private:
+    template <class T, void (*H)(T*)>
+    static void invokeInline(Task* task)
+    {
+        H(reinterpret_cast<T*>(task->payload));
+    }
+};
+
+/*
+ * Anything that accepts Tasks for execution: a TaskQueue drained by
+ * worker threads, or a WorkPool. tryEnqueue fails instead of
+ * blocking if the sink is full; sinks that are never full just
+ * enqueue.
+ */
+class TaskSink {
+    public:
+    virtual ~TaskSink() { }
+    virtual void enqueue(Task task) = 0;
+    virtual bool tryEnqueue(const Task& task)
+    {
+        enqueue(task);
+        return true;
+    }
+};
@@ -1,20 +1,37 @@
+#include <cassert>
+
 #include "TaskQueue.h"
+#include "Log.h"
 
-void Printf(char * str){
-  puts(str);
-  fflush(stdout);
+void Printf(const char * str){
+  log_write(LOG_INFO, "%s\n", (const char*) str);
 }
 TaskQueue::
-TaskQueue()
+TaskQueue(TaskQueueBackend backend, size_t capacity)
+    : backend(backend), laneCapacity(capacity), dequeues(0),
+      sleepers(0), blocked(0), closed(false), unfinished(0), drainers(0)
 {
+  assert(capacity > 0);
   smutex_init(&lock);
   scond_init(&queue_empty);
+  scond_init(&queue_full);
+  scond_init(&drained);
+  for (int p = 0; p < TASK_NUM_PRIORITIES; p++){
+    rings[p] = NULL;
+    if (backend == TQ_LOCKFREE){
+      rings[p] = new TaskRing(capacity);
+    }
+  }
 }
 
 TaskQueue::
 ~TaskQueue()
 {
-  Printf("I am Destroying");
+  for (int p = 0; p < TASK_NUM_PRIORITIES; p++){
+    delete rings[p];
+  }
+  scond_destroy(&drained);
+  scond_destroy(&queue_full);
   scond_destroy(&queue_empty);
   smutex_destroy(&lock);
 }
@@ -33,8 +50,17 @@ TaskQueue::
 int TaskQueue::
 size()
 {
+  int size = 0;
+  if (backend == TQ_LOCKFREE){
+    for (int p = 0; p < TASK_NUM_PRIORITIES; p++){
+      size += rings[p]->size();
+    }
+    return size;
+  }
   smutex_lock(&lock);
-  int size = dq.size();
+  for (int p = 0; p < TASK_NUM_PRIORITIES; p++){
+    size += lanes[p].size();
+  }
   smutex_unlock(&lock);
   return size;
 }
@@ -53,17 +79,203 @@ size()
 bool TaskQueue::
 empty()
 {
-  smutex_lock(&lock);
-  bool empty = dq.empty();
-  smutex_unlock(&lock);
-  return empty; // Keep compiler happy until routine done.
+  return size() == 0;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * wakeConsumer --
+ *
+ *      Called by a producer after it published a task to the ring.
+ *      Signal one parked consumer, if any.
+ *
+ *      The fence pairs with the one in dequeue: either the
+ *      consumer sees the new task when it re-checks the ring, or
+ *      we see its sleepers count and signal it under the lock.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+wakeConsumer()
+{
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleepers.load(std::memory_order_relaxed) > 0){
+    smutex_lock(&lock);
+    scond_signal(&queue_empty, &lock);
+    smutex_unlock(&lock);
+  }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * wakeProducer --
+ *
+ *      Called by a consumer after it freed a slot in a ring.
+ *      Wake the producers parked on a full ring, if any. They may
+ *      be waiting for different lanes, so waking just one could
+ *      pick one whose lane is still full.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+wakeProducer()
+{
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (blocked.load(std::memory_order_relaxed) > 0){
+    smutex_lock(&lock);
+    scond_broadcast(&queue_full, &lock);
+    smutex_unlock(&lock);
+  }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * passWakeups --
+ *
+ *      Called after a successful push or pop on the ring. If tasks
+ *      are left, wake another parked consumer for them; if room is
+ *      left, wake another parked producer.
+ *
+ *      A wakeup can be absorbed without making progress: tryPop
+ *      fails on a slot whose producer has claimed it but not yet
+ *      published it, even though a later slot is full, and the
+ *      woken consumer parks again (likewise tryPush on a slot a
+ *      consumer has not yet released). Passing the wakeup on from
+ *      every successful operation makes sure the later task or
+ *      free slot is not stranded.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+passWakeups()
+{
+  bool tasksLeft = false;
+  bool roomLeft = false;
+  for (int p = 0; p < TASK_NUM_PRIORITIES; p++){
+    size_t n = rings[p]->size();
+    tasksLeft |= n > 0;
+    roomLeft |= n < rings[p]->capacity();
+  }
+  if (tasksLeft){
+    wakeConsumer();
+  }
+  if (roomLeft){
+    wakeProducer();
+  }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * tryPopAny --
+ *
+ *      Pop one task from the lock-free lanes without blocking,
+ *      trying the most urgent lane first, or the least urgent one
+ *      first if agedTurn is set.
+ *
+ * Results:
+ *      True if a task was stored in *task, false if every lane
+ *      looked empty.
+ *
+ * ------------------------------------------------------------------
+ */
+bool TaskQueue::
+tryPopAny(Task* task, bool agedTurn)
+{
+  for (int i = 0; i < TASK_NUM_PRIORITIES; i++){
+    int p = agedTurn ? TASK_NUM_PRIORITIES - 1 - i : i;
+    if (rings[p]->tryPop(task)){
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * nextLane --
+ *
+ *      Pick the lane the next dequeue from the locked backend takes
+ *      from. Called with the queue lock held.
+ *
+ * Results:
+ *      The index of the lane, or -1 if every lane is empty.
+ *
+ * ------------------------------------------------------------------
+ */
+int TaskQueue::
+nextLane()
+{
+  bool agedTurn = (dequeues.load(std::memory_order_relaxed) + 1)
+                  % TASK_AGING_INTERVAL == 0;
+  for (int i = 0; i < TASK_NUM_PRIORITIES; i++){
+    int p = agedTurn ? TASK_NUM_PRIORITIES - 1 - i : i;
+    if (!lanes[p].empty()){
+      return p;
+    }
+  }
+  return -1;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * popLane --
+ *
+ *      Remove and return the task nextLane picks. Called with the
+ *      queue lock held, and only when the queue is not empty.
+ *
+ * Results:
+ *      The Task that was removed.
+ *
+ * ------------------------------------------------------------------
+ */
+Task TaskQueue::
+popLane()
+{
+  int p = nextLane();
+  assert(p >= 0);
+  dequeues.fetch_add(1, std::memory_order_relaxed);
+  Task t = lanes[p].front();
+  lanes[p].pop_front();
+  return t;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * wakeProducersLocked --
+ *
+ *      Called with the queue lock held after tasks were removed
+ *      from the locked backend. Wake the producers waiting for a
+ *      full lane, if any; as in wakeProducer, they may be waiting
+ *      for different lanes.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+wakeProducersLocked()
+{
+  if (blocked.load(std::memory_order_relaxed) > 0){
+    scond_broadcast(&queue_full, &lock);
+  }
 }
 
 /*
  * ------------------------------------------------------------------
  * enqueue --
  *
- *      Insert the task at the back of the queue.
+ *      Insert the task at the back of its priority lane, blocking
+ *      while that lane is full.
  *
  * Results:
  *      None.
@@ -73,34 +285,394 @@ empty()
 void TaskQueue::
 enqueue(Task task)
 {
+  assert(task.priority < TASK_NUM_PRIORITIES);
+  assert(!closed.load(std::memory_order_relaxed));
+  // Counted before it is published, so a consumer that finishes it
+  // at once cannot take unfinished below zero.
+  unfinished.fetch_add(1, std::memory_order_relaxed);
+  if (backend == TQ_LOCKFREE){
+    TaskRing* ring = rings[task.priority];
+    for (int i = 0; i < TASK_SPIN_LIMIT; i++){
+      if (ring->tryPush(task)){
+        passWakeups();
+        return;
+      }
+      cpu_relax();
+    }
+    smutex_lock(&lock);
+    blocked.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (!ring->tryPush(task)){
+      scond_wait(&queue_full, &lock);
+    }
+    blocked.fetch_sub(1);
+    smutex_unlock(&lock);
+    passWakeups();
+    return;
+  }
+  std::deque<Task>& lane = lanes[task.priority];
   smutex_lock(&lock);
-  dq.push_back(task);
+  while (lane.size() >= laneCapacity){
+    blocked.fetch_add(1, std::memory_order_relaxed);
+    scond_wait(&queue_full, &lock);
+    blocked.fetch_sub(1, std::memory_order_relaxed);
+  }
+  lane.push_back(task);
   scond_signal(&queue_empty, &lock);
   smutex_unlock(&lock);
 }
 
+/*
+ * ------------------------------------------------------------------
+ * tryEnqueue --
+ *
+ *      Insert the task at the back of its priority lane, unless
+ *      that lane is full or the queue is closed. Generators use it
+ *      to count how often the queue holds them back.
+ *
+ * Results:
+ *      True if the task was inserted, false if the lane was full
+ *      or the queue closed.
+ *
+ * ------------------------------------------------------------------
+ */
+bool TaskQueue::
+tryEnqueue(const Task& task)
+{
+  assert(task.priority < TASK_NUM_PRIORITIES);
+  if (closed.load(std::memory_order_relaxed)){
+    return false;
+  }
+  unfinished.fetch_add(1, std::memory_order_relaxed);
+  if (backend == TQ_LOCKFREE){
+    if (!rings[task.priority]->tryPush(task)){
+      taskDone();
+      return false;
+    }
+    passWakeups();
+    return true;
+  }
+  std::deque<Task>& lane = lanes[task.priority];
+  smutex_lock(&lock);
+  bool room = lane.size() < laneCapacity;
+  if (room){
+    lane.push_back(task);
+    scond_signal(&queue_empty, &lock);
+  }
+  smutex_unlock(&lock);
+  if (!room){
+    taskDone();
+  }
+  return room;
+}
+
+/*
+ * Count a lock-free dequeue turn. Every TASK_AGING_INTERVAL-th turn
+ * of the queue, whichever consumer takes it, is an aging turn.
+ */
+bool TaskQueue::
+nextTurnAged()
+{
+  return (dequeues.fetch_add(1, std::memory_order_relaxed) + 1)
+         % TASK_AGING_INTERVAL == 0;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * waitForTask --
+ *
+ *      Remove a task from the queue, waiting until deadline (a
+ *      sthread_now_ns time, or TASK_NO_DEADLINE to wait for as long
+ *      as it takes) while the queue is empty and not closed.
+ *
+ *      The lock-free backend does not pass wakeups on; the caller
+ *      calls passWakeups once it is done taking tasks. The locked
+ *      backend returns with the queue lock held if it got a task.
+ *
+ * Results:
+ *      True and the task in *task, or false if the deadline passed
+ *      or the queue is closed and empty.
+ *
+ * ------------------------------------------------------------------
+ */
+bool TaskQueue::
+waitForTask(Task* task, uint64_t deadline)
+{
+  bool got = false;
+  if (backend == TQ_LOCKFREE){
+    bool agedTurn = nextTurnAged();
+    for (int i = 0; i < TASK_SPIN_LIMIT; i++){
+      if (tryPopAny(task, agedTurn)){
+        return true;
+      }
+      cpu_relax();
+    }
+    smutex_lock(&lock);
+    sleepers.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (!(got = tryPopAny(task, agedTurn))){
+      if (closed.load()){
+        break;
+      }
+      if (deadline == TASK_NO_DEADLINE){
+        scond_wait(&queue_empty, &lock);
+      } else if (!scond_timedwait(&queue_empty, &lock, deadline)){
+        got = tryPopAny(task, agedTurn);
+        break;
+      }
+    }
+    sleepers.fetch_sub(1);
+    smutex_unlock(&lock);
+    return got;
+  }
+  smutex_lock(&lock);
+  while (!(got = nextLane() >= 0)){
+    if (closed.load(std::memory_order_relaxed)){
+      break;
+    }
+    if (deadline == TASK_NO_DEADLINE){
+      scond_wait(&queue_empty, &lock);
+    } else if (!scond_timedwait(&queue_empty, &lock, deadline)){
+      got = nextLane() >= 0;
+      break;
+    }
+  }
+  if (!got){
+    smutex_unlock(&lock);
+    return false;
+  }
+  *task = popLane();
+  return true;
+}
+
 /*
  * ------------------------------------------------------------------
  * dequeue --
  *
- *      Remove the Task at the front of the queue and return it.
- *      If the queue is empty, block until a Task is inserted.
+ *      Remove the Task at the front of the most urgent non-empty
+ *      lane (the least urgent one on an aging turn). If the queue
+ *      is empty, block until a Task is inserted or the queue is
+ *      closed.
  *
  * Results:
- *      The Task at the front of the queue.
+ *      True and the Task in *task, or false at the end of the
+ *      stream: the queue is closed and empty.
  *
  * ------------------------------------------------------------------
  */
-Task TaskQueue::
-dequeue()
+bool TaskQueue::
+dequeue(Task* task)
+{
+  if (!waitForTask(task, TASK_NO_DEADLINE)){
+    return false;
+  }
+  if (backend == TQ_LOCKFREE){
+    passWakeups();
+  } else {
+    wakeProducersLocked();
+    smutex_unlock(&lock);
+  }
+  return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * tryDequeue --
+ *
+ *      Like dequeue, but fail instead of blocking if the queue is
+ *      empty.
+ *
+ * Results:
+ *      True and the task in *task, or false if the queue was empty.
+ *
+ * ------------------------------------------------------------------
+ */
+bool TaskQueue::
+tryDequeue(Task* task)
 {
+  if (backend == TQ_LOCKFREE){
+    if (!tryPopAny(task, nextTurnAged())){
+      return false;
+    }
+    passWakeups();
+    return true;
+  }
   smutex_lock(&lock);
-  while(dq.empty()){
-    scond_wait(&queue_empty, &lock);
+  bool got = nextLane() >= 0;
+  if (got){
+    *task = popLane();
+    wakeProducersLocked();
   }
-  Task t = dq.front();
-  dq.pop_front();
   smutex_unlock(&lock);
-  return t;
+  return got;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * dequeueFor --
+ *
+ *      Like dequeue, but give up if the queue stays empty for
+ *      timeoutNs nanoseconds. 0 takes a task only if one is there
+ *      right away, like tryDequeue.
+ *
+ * Results:
+ *      True and the task in *task, or false on timeout or at the
+ *      end of the stream (see isClosed).
+ *
+ * ------------------------------------------------------------------
+ */
+bool TaskQueue::
+dequeueFor(Task* task, uint64_t timeoutNs)
+{
+  uint64_t now = sthread_now_ns();
+  uint64_t deadline = timeoutNs < TASK_NO_DEADLINE - now ? now + timeoutNs
+                                                         : TASK_NO_DEADLINE;
+  bool got = waitForTask(task, deadline);
+  if (backend == TQ_LOCKFREE){
+    // A wakeup that raced with the timeout may have been meant for
+    // us; pass it on if there is anything to do.
+    passWakeups();
+  } else if (got){
+    wakeProducersLocked();
+    smutex_unlock(&lock);
+  }
+  return got;
 }
 
+/*
+ * ------------------------------------------------------------------
+ * dequeueMany --
+ *
+ *      Remove up to max tasks, in the order dequeue would return
+ *      them, into tasks[]. Block until at least one is available
+ *      (or the queue is closed), but not for more.
+ *
+ *      The queue lock (locked backend) or the wakeups (lock-free
+ *      backend) are paid for once per batch instead of per task.
+ *
+ * Results:
+ *      The number of tasks stored in tasks[], at least 1, or 0 at
+ *      the end of the stream.
+ *
+ * ------------------------------------------------------------------
+ */
+int TaskQueue::
+dequeueMany(Task* tasks, int max)
+{
+  assert(max > 0);
+  if (!waitForTask(&tasks[0], TASK_NO_DEADLINE)){
+    return 0;
+  }
+  int n = 1;
+  if (backend == TQ_LOCKFREE){
+    while (n < max && tryPopAny(&tasks[n], nextTurnAged())){
+      n++;
+    }
+    passWakeups();
+    return n;
+  }
+  while (n < max && nextLane() >= 0){
+    tasks[n++] = popLane();
+  }
+  wakeProducersLocked();
+  smutex_unlock(&lock);
+  return n;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * taskDone --
+ *
+ *      Called by a consumer once it has finished running a task it
+ *      dequeued. Wakes drain() callers when the last outstanding
+ *      task is done.
+ *
+ *      The drainers check pairs with the one in drain, as sleepers
+ *      does for parked consumers: either drain sees unfinished drop
+ *      to zero, or we see it waiting and broadcast under the lock.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+taskDone()
+{
+  long left = unfinished.fetch_sub(1);
+  assert(left > 0);
+  if (left == 1 && drainers.load() > 0){
+    smutex_lock(&lock);
+    scond_broadcast(&drained, &lock);
+    smutex_unlock(&lock);
+  }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * close --
+ *
+ *      End the stream: wake every consumer waiting on an empty
+ *      queue, and make dequeue return false, rather than block,
+ *      once the tasks still in the queue are gone. Call it after
+ *      the producers are done; enqueue on a closed queue is an
+ *      error and tryEnqueue fails.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+close()
+{
+  smutex_lock(&lock);
+  closed.store(true);
+  scond_broadcast(&queue_empty, &lock);
+  smutex_unlock(&lock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * drain --
+ *
+ *      Wait until every task enqueued so far has been dequeued and
+ *      reported done with taskDone. The queue stays open, so
+ *      producers can start another round afterwards.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+drain()
+{
+  smutex_lock(&lock);
+  drainers.fetch_add(1);
+  while (unfinished.load() > 0){
+    scond_wait(&drained, &lock);
+  }
+  drainers.fetch_sub(1);
+  smutex_unlock(&lock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * capacity --
+ *
+ *      Return how many tasks each priority lane holds at most.
+ *
+ * Results:
+ *      The lane capacity.
+ *
+ * ------------------------------------------------------------------
+ */
+size_t TaskQueue::
+capacity() const
+{
+  if (backend == TQ_LOCKFREE){
+    return rings[0]->capacity();
+  }
+  return laneCapacity;
+}
@@ -2,14 +2,34 @@
 
 
 #include "sthread.h"
+#include "Task.h"
+#include "TaskRing.h"
+#include <atomic>
 #include <deque>
 #include <cstdio>
+#include <cstdint>
 
-typedef void (*handler_t) (void *); 
+#define TASK_QUEUE_CAPACITY 1024
+#define TASK_SPIN_LIMIT     128
 
-struct Task {
-    handler_t handler;
-    void* arg;
+// Every TASK_AGING_INTERVAL-th dequeue serves the least urgent
+// non-empty lane first, so a flood of urgent tasks cannot starve
+// the others. This is a fixed ratio of turns, not a bound on how
+// long a task may wait.
+#define TASK_AGING_INTERVAL 8
+
+// Deadline for TaskQueue::waitForTask meaning "wait forever".
+#define TASK_NO_DEADLINE    UINT64_MAX
+
+/*
+ * How a TaskQueue stores the tasks of each priority lane:
+ *      TQ_LOCKED   - a std::deque guarded by the queue lock.
+ *      TQ_LOCKFREE - a lock-free TaskRing. The queue lock is only
+ *                    taken to park and wake threads.
+ */
+enum TaskQueueBackend {
+    TQ_LOCKED = 0,
+    TQ_LOCKFREE
 };
 
 /*
@@ -19,22 +39,84 @@ struct Task {
  *      A thread-safe task queue. This queue should be implemented
  *      as a monitor.
  *
+ *      Tasks are kept in one FIFO lane per TaskPriority, and dequeue
+ *      takes from the most urgent non-empty lane, except that every
+ *      TASK_AGING_INTERVAL-th dequeue of the queue starts from the
+ *      least urgent lane instead. The less urgent lanes thus get a
+ *      fixed share of the turns, whatever their tasks' age.
+ *
+ *      Each lane holds at most capacity tasks (rounded up to a power
+ *      of two with the lock-free backend). enqueue blocks while the
+ *      task's lane is full, so producers that outrun the consumers
+ *      are held back rather than growing the queue; tryEnqueue fails
+ *      instead. On the consumer side, dequeue blocks while the queue
+ *      is empty, tryDequeue fails, dequeueFor gives up after a
+ *      timeout, and dequeueMany takes a batch of tasks at the cost
+ *      of one wait, one lock hold and one round of wakeups.
+ *
+ *      close() ends the stream once the producers are done:
+ *      consumers still get the tasks left in the queue, then
+ *      dequeue returns false (dequeueMany 0) instead of blocking.
+ *      Consumers that call taskDone after running each task they
+ *      dequeued let drain() wait for every task enqueued so far to
+ *      finish, so the same queue and workers can be reused for
+ *      another round of work.
+ *
+ *      With the TQ_LOCKFREE backend, enqueue and dequeue go through
+ *      the ring without the lock. A consumer that finds the ring
+ *      empty spins for a short while before parking on queue_empty,
+ *      and a producer that finds it full does the same on
+ *      queue_full. The sleepers/blocked counts let the other side
+ *      skip the lock entirely when nobody is parked.
+ *
  * ------------------------------------------------------------------
  */
-class TaskQueue {
+class TaskQueue : public TaskSink {
     private:
+  const TaskQueueBackend backend;
   smutex_t lock;
   scond_t queue_empty;
-  std::deque<Task> dq;
+  scond_t queue_full;
+  const size_t laneCapacity;
+  std::deque<Task> lanes[TASK_NUM_PRIORITIES];
+  TaskRing* rings[TASK_NUM_PRIORITIES];
+  alignas(CACHE_LINE_SIZE) std::atomic<unsigned long> dequeues;
+  std::atomic<int> sleepers;
+  std::atomic<int> blocked;
+  std::atomic<bool> closed;
+  std::atomic<long> unfinished;
+  std::atomic<int> drainers;
+  scond_t drained;
+
+  void wakeConsumer();
+  void wakeProducer();
+  void passWakeups();
+  bool nextTurnAged();
+  bool tryPopAny(Task* task, bool agedTurn);
+  int nextLane();
+  Task popLane();
+  void wakeProducersLocked();
+  bool waitForTask(Task* task, uint64_t deadline);
     public:
-    TaskQueue();
+    explicit TaskQueue(TaskQueueBackend backend = TQ_LOCKED,
+                       size_t capacity = TASK_QUEUE_CAPACITY);
     ~TaskQueue();
 
     void enqueue(Task task);
-    Task dequeue();
+    bool tryEnqueue(const Task& task);
+    bool dequeue(Task* task);
+    bool tryDequeue(Task* task);
+    bool dequeueFor(Task* task, uint64_t timeoutNs);
+    int dequeueMany(Task* tasks, int max);
+    void taskDone();
+
+    void close();
+    void drain();
+    bool isClosed() const { return closed.load(); }
 
     int size();
     bool empty();
+    size_t capacity() const;
 };
 
-void Printf(char *);
+void Printf(const char *);
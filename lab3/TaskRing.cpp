@@ -0,0 +1,121 @@
+#include <cstdint>
+
+#include "TaskRing.h"
+
+TaskRing::
+TaskRing(size_t capacity)
+    : head(0), tail(0)
+{
+  size_t n = 2;
+  while (n < capacity){
+    n <<= 1;
+  }
+  mask = n - 1;
+  slots = new Slot[n];
+  for (size_t i = 0; i < n; i++){
+    slots[i].seq.store(i, std::memory_order_relaxed);
+  }
+}
+
+TaskRing::
+~TaskRing()
+{
+  delete[] slots;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * tryPush --
+ *
+ *      Insert the task at the tail of the ring if there is room.
+ *
+ *      A slot is free for the producer that claims position pos
+ *      when its sequence number equals pos. After writing the task
+ *      the producer publishes it by setting the sequence to pos + 1,
+ *      which is what the consumer of pos waits for.
+ *
+ * Results:
+ *      True if the task was inserted, false if the ring is full.
+ *
+ * ------------------------------------------------------------------
+ */
+bool TaskRing::
+tryPush(const Task& task)
+{
+  size_t pos = tail.load(std::memory_order_relaxed);
+  while (true){
+    Slot* slot = &slots[pos & mask];
+    size_t seq = slot->seq.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+    if (diff == 0){
+      if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+        slot->task = task;
+        slot->seq.store(pos + 1, std::memory_order_release);
+        return true;
+      }
+    } else if (diff < 0){
+      return false;
+    } else {
+      pos = tail.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * tryPop --
+ *
+ *      Remove the task at the head of the ring if there is one.
+ *
+ *      The slot at position pos holds a task once its sequence
+ *      number is pos + 1. After copying the task out the consumer
+ *      hands the slot back to producers for the next lap by setting
+ *      the sequence to pos + capacity.
+ *
+ * Results:
+ *      True and the task in *task, or false if the ring is empty.
+ *
+ * ------------------------------------------------------------------
+ */
+bool TaskRing::
+tryPop(Task* task)
+{
+  size_t pos = head.load(std::memory_order_relaxed);
+  while (true){
+    Slot* slot = &slots[pos & mask];
+    size_t seq = slot->seq.load(std::memory_order_acquire);
+    intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+    if (diff == 0){
+      if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+        *task = slot->task;
+        slot->seq.store(pos + mask + 1, std::memory_order_release);
+        return true;
+      }
+    } else if (diff < 0){
+      return false;
+    } else {
+      pos = head.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * size --
+ *
+ *      Return the number of tasks in the ring. This is only a
+ *      snapshot: concurrent pushes and pops may change it before
+ *      the caller looks at it.
+ *
+ * Results:
+ *      The approximate size of the ring.
+ *
+ * ------------------------------------------------------------------
+ */
+size_t TaskRing::
+size() const
+{
+  size_t h = head.load(std::memory_order_acquire);
+  size_t t = tail.load(std::memory_order_acquire);
+  return t > h ? t - h : 0;
+}
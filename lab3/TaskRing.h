@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+#include "sthread.h"
+#include "Task.h"
+
+/*
+ * ------------------------------------------------------------------
+ * TaskRing --
+ *
+ *      A bounded lock-free multi-producer/multi-consumer ring of
+ *      Tasks.
+ *
+ *      Every slot carries a sequence number that tells producers
+ *      and consumers whose turn it is to use the slot, so the only
+ *      shared writes are one CAS on head (consumers) or tail
+ *      (producers) per operation. head and tail live on separate
+ *      cache lines so producers and consumers do not bounce each
+ *      other's line.
+ *
+ *      The capacity is rounded up to a power of two. tryPush and
+ *      tryPop never block; callers that want to wait build that on
+ *      top (see TaskQueue).
+ *
+ * ------------------------------------------------------------------
+ */
+class TaskRing {
+    private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        Task task;
+    };
+
+    Slot* slots;
+    size_t mask;
+
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> head;
+    alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail;
+
+    public:
+    explicit TaskRing(size_t capacity);
+    ~TaskRing();
+
+    bool tryPush(const Task& task);
+    bool tryPop(Task* task);
+
+    size_t size() const;
+    size_t capacity() const { return mask + 1; }
+};
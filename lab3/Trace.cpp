@@ -0,0 +1,255 @@
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include "Trace.h"
+
+/*
+ * Start a record of the given type with every argument cleared, so
+ * that unused fields are written out as zeros.
+ */
+static void
+trace_begin(TraceRecord* rec, int type)
+{
+  memset(rec, 0, sizeof(*rec));
+  rec->type = type;
+}
+
+void
+trace_encode(const AddItemReq& req, TraceRecord* rec)
+{
+  trace_begin(rec, ADD_ITEM);
+  rec->item_id = req.item_id;
+  rec->count = req.quantity;
+  rec->amount = req.price;
+  rec->discount = req.discount;
+}
+
+void
+trace_encode(const RemoveItemReq& req, TraceRecord* rec)
+{
+  trace_begin(rec, REMOVE_ITEM);
+  rec->item_id = req.item_id;
+}
+
+void
+trace_encode(const AddStockReq& req, TraceRecord* rec)
+{
+  trace_begin(rec, ADD_STOCK);
+  rec->item_id = req.item_id;
+  rec->count = req.additional_stock;
+}
+
+void
+trace_encode(const ChangeItemPriceReq& req, TraceRecord* rec)
+{
+  trace_begin(rec, CHANGE_ITEM_PRICE);
+  rec->item_id = req.item_id;
+  rec->amount = req.new_price;
+}
+
+void
+trace_encode(const ChangeItemDiscountReq& req, TraceRecord* rec)
+{
+  trace_begin(rec, CHANGE_ITEM_DISCOUNT);
+  rec->item_id = req.item_id;
+  rec->amount = req.new_discount;
+}
+
+void
+trace_encode(const SetShippingCostReq& req, TraceRecord* rec)
+{
+  trace_begin(rec, SET_SHIPPING_COST);
+  rec->amount = req.new_cost;
+}
+
+void
+trace_encode(const SetStoreDiscountReq& req, TraceRecord* rec)
+{
+  trace_begin(rec, SET_STORE_DISCOUNT);
+  rec->amount = req.new_discount;
+}
+
+/*
+ * A batched supplier op is recorded like the request it stands for,
+ * so a batch replays as its ops, one request each.
+ */
+void
+trace_encode(const SupplierOp& op, TraceRecord* rec)
+{
+  trace_begin(rec, op.type);
+  rec->item_id = op.item_id;
+  rec->count = op.count;
+  rec->amount = op.amount;
+  rec->discount = op.discount;
+}
+
+void
+trace_encode(const BuyItemReq& req, TraceRecord* rec)
+{
+  trace_begin(rec, TRACE_BUY_ITEM);
+  rec->item_id = req.item_id;
+  rec->amount = req.budget;
+}
+
+void
+trace_encode(const BuyManyItemsReq& req, TraceRecord* rec)
+{
+  trace_begin(rec, TRACE_BUY_MANY_ITEMS);
+  rec->num_items = req.num_items;
+  memcpy(rec->item_ids, req.item_ids, req.num_items * sizeof(int));
+  rec->amount = req.budget;
+}
+
+TraceWriter::
+TraceWriter()
+    : file(NULL), start(0), written(0)
+{
+  smutex_init(&lock);
+}
+
+TraceWriter::
+~TraceWriter()
+{
+  close();
+  smutex_destroy(&lock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * open --
+ *
+ *      Create (or truncate) the trace file at path and write its
+ *      header. Record times are measured from now.
+ *
+ * Results:
+ *      True on success; false, with errno set, if the file could
+ *      not be created.
+ *
+ * ------------------------------------------------------------------
+ */
+bool TraceWriter::
+open(const char* path)
+{
+  assert(file == NULL);
+  file = fopen(path, "wb");
+  if (file == NULL){
+    return false;
+  }
+  TraceHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+  header.version = TRACE_VERSION;
+  header.record_size = sizeof(TraceRecord);
+  if (fwrite(&header, sizeof(header), 1, file) != 1){
+    perror("trace write failed");
+    exit(-1);
+  }
+  start = sthread_now_ns();
+  written = 0;
+  return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * close --
+ *
+ *      Flush and close the trace file, if one is open.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TraceWriter::
+close()
+{
+  if (file == NULL){
+    return;
+  }
+  if (fclose(file) != 0){
+    perror("trace close failed");
+    exit(-1);
+  }
+  file = NULL;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * write --
+ *
+ *      Stamp rec with the time since open and append it to the
+ *      trace. rec->source must already be set.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TraceWriter::
+write(TraceRecord* rec)
+{
+  assert(rec->source < NUM_TRACE_SOURCES);
+  smutex_lock(&lock);
+  rec->time_ns = sthread_now_ns() - start;
+  if (fwrite(rec, sizeof(*rec), 1, file) != 1){
+    perror("trace write failed");
+    exit(-1);
+  }
+  written++;
+  smutex_unlock(&lock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * trace_load --
+ *
+ *      Read the trace file at path into memory, one vector of
+ *      records per TraceSource, each in the order it was written.
+ *
+ * Results:
+ *      True on success. On failure, print why to stderr and return
+ *      false.
+ *
+ * ------------------------------------------------------------------
+ */
+bool
+trace_load(const char* path, std::vector<TraceRecord> bySource[NUM_TRACE_SOURCES])
+{
+  FILE* file = fopen(path, "rb");
+  if (file == NULL){
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return false;
+  }
+
+  TraceHeader header;
+  bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+            memcmp(header.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) == 0;
+  if (!ok){
+    fprintf(stderr, "%s: not a trace file\n", path);
+  } else if (header.version != TRACE_VERSION ||
+             header.record_size != sizeof(TraceRecord)){
+    fprintf(stderr, "%s: unsupported trace version %u\n",
+            path, header.version);
+    ok = false;
+  }
+
+  TraceRecord rec;
+  while (ok && fread(&rec, sizeof(rec), 1, file) == 1){
+    if (rec.source >= NUM_TRACE_SOURCES ||
+        rec.type >= NUM_TRACE_REQUEST_TYPES ||
+        rec.num_items > MAX_BUY_ITEM){
+      fprintf(stderr, "%s: corrupt record\n", path);
+      ok = false;
+      break;
+    }
+    bySource[rec.source].push_back(rec);
+  }
+  if (ok && ferror(file)){
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    ok = false;
+  }
+  fclose(file);
+  return ok;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "sthread.h"
+#include "Request.h"
+
+/*
+ * ------------------------------------------------------------------
+ * Request traces --
+ *
+ *      A trace file records every request the generators made, so
+ *      that a run can be replayed (see ReplayRequestGenerator) with
+ *      exactly the same workload, e.g. under another store mode.
+ *
+ *      The file is a TraceHeader followed by fixed-size
+ *      TraceRecords in the order they were written, all in the
+ *      recording machine's byte order. Each record carries the
+ *      generator that made it (source), the request type and
+ *      arguments, and the time since the trace was opened.
+ *
+ * ------------------------------------------------------------------
+ */
+
+#define TRACE_MAGIC     "ESTRACE"
+#define TRACE_VERSION   1
+
+enum TraceSource {
+    TRACE_SUPPLIER = 0,
+    TRACE_CUSTOMER,
+    NUM_TRACE_SOURCES
+};
+
+/*
+ * Supplier requests use their SupplierRequestTypes value as the
+ * record type; customer requests follow.
+ */
+enum TraceRequestTypes {
+    TRACE_BUY_ITEM = NUM_SUPPLIER_REQUEST_TYPES,
+    TRACE_BUY_MANY_ITEMS,
+    NUM_TRACE_REQUEST_TYPES
+};
+
+struct TraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+struct TraceRecord {
+    uint64_t time_ns;
+    uint8_t source;
+    uint8_t type;
+    uint8_t num_items;          // BUY_MANY_ITEMS
+    uint8_t unused;
+    int32_t item_id;            // per-item requests, BUY_ITEM
+    int32_t count;              // ADD_ITEM quantity, ADD_STOCK stock
+    double amount;              // price, discount, cost or budget
+    double discount;            // ADD_ITEM
+    int32_t item_ids[MAX_BUY_ITEM];
+};
+
+void trace_encode(const AddItemReq& req, TraceRecord* rec);
+void trace_encode(const RemoveItemReq& req, TraceRecord* rec);
+void trace_encode(const AddStockReq& req, TraceRecord* rec);
+void trace_encode(const ChangeItemPriceReq& req, TraceRecord* rec);
+void trace_encode(const ChangeItemDiscountReq& req, TraceRecord* rec);
+void trace_encode(const SetShippingCostReq& req, TraceRecord* rec);
+void trace_encode(const SetStoreDiscountReq& req, TraceRecord* rec);
+void trace_encode(const SupplierOp& op, TraceRecord* rec);
+void trace_encode(const BuyItemReq& req, TraceRecord* rec);
+void trace_encode(const BuyManyItemsReq& req, TraceRecord* rec);
+
+/*
+ * ------------------------------------------------------------------
+ * TraceWriter --
+ *
+ *      Appends records to a trace file. Several generator threads
+ *      may share one writer; records are timestamped and written
+ *      under a lock, through stdio's buffer.
+ *
+ * ------------------------------------------------------------------
+ */
+class TraceWriter {
+    private:
+    FILE* file;
+    smutex_t lock;
+    uint64_t start;
+    long written;
+
+    public:
+    TraceWriter();
+    ~TraceWriter();
+
+    bool open(const char* path);
+    void close();
+    void write(TraceRecord* rec);
+    long recordCount() const { return written; }
+};
+
+bool trace_load(const char* path,
+                std::vector<TraceRecord> bySource[NUM_TRACE_SOURCES]);
@@ -0,0 +1,361 @@
+#include "WorkPool.h"
+#include "Bench.h"
+
+/*
+ * The worker running on this thread, if it belongs to a WorkPool.
+ */
+static thread_local void* currentWorker = NULL;
+
+WorkDeque::
+WorkDeque()
+    : top(0), bottom(0)
+{
+}
+
+/*
+ * ------------------------------------------------------------------
+ * push --
+ *
+ *      Push the task at the bottom of the deque. Owner only.
+ *
+ * Results:
+ *      True if the task was pushed, false if the deque is full.
+ *
+ * ------------------------------------------------------------------
+ */
+bool WorkDeque::
+push(const Task& task)
+{
+  int64_t b = bottom.load(std::memory_order_relaxed);
+  int64_t t = top.load(std::memory_order_acquire);
+  if (b - t >= WORK_DEQUE_CAPACITY){
+    return false;
+  }
+  tasks[b % WORK_DEQUE_CAPACITY] = task;
+  std::atomic_thread_fence(std::memory_order_release);
+  bottom.store(b + 1, std::memory_order_relaxed);
+  return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * take --
+ *
+ *      Pop the task at the bottom of the deque. Owner only.
+ *
+ *      If only one task is left we race the thieves for it with the
+ *      same CAS on top that they use.
+ *
+ * Results:
+ *      True and the task in *task, or false if the deque is empty.
+ *
+ * ------------------------------------------------------------------
+ */
+bool WorkDeque::
+take(Task* task)
+{
+  int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+  bottom.store(b, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t t = top.load(std::memory_order_relaxed);
+  if (t > b){
+    bottom.store(b + 1, std::memory_order_relaxed);
+    return false;
+  }
+  *task = tasks[b % WORK_DEQUE_CAPACITY];
+  if (t == b){
+    bool won = top.compare_exchange_strong(t, t + 1,
+                                           std::memory_order_seq_cst,
+                                           std::memory_order_relaxed);
+    bottom.store(b + 1, std::memory_order_relaxed);
+    return won;
+  }
+  return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * steal --
+ *
+ *      Take the task at the top of the deque. Any thread.
+ *
+ *      The copy out of the slot may race with the owner reusing
+ *      that slot once another thief has moved top past it, but in
+ *      that case our CAS on top fails and the copy is thrown away.
+ *
+ * Results:
+ *      True and the task in *task, or false if the deque was empty
+ *      or another thread got the task first.
+ *
+ * ------------------------------------------------------------------
+ */
+bool WorkDeque::
+steal(Task* task)
+{
+  int64_t t = top.load(std::memory_order_acquire);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t b = bottom.load(std::memory_order_acquire);
+  if (t >= b){
+    return false;
+  }
+  Task stolen = tasks[t % WORK_DEQUE_CAPACITY];
+  if (!top.compare_exchange_strong(t, t + 1,
+                                   std::memory_order_seq_cst,
+                                   std::memory_order_relaxed)){
+    return false;
+  }
+  *task = stolen;
+  return true;
+}
+
+bool WorkDeque::
+empty() const
+{
+  int64_t b = bottom.load(std::memory_order_acquire);
+  int64_t t = top.load(std::memory_order_acquire);
+  return b <= t;
+}
+
+WorkPool::
+WorkPool(int numWorkers)
+    : numWorkers(numWorkers), numInjected(0), sleepers(0), stopping(false)
+{
+  smutex_init(&lock);
+  scond_init(&idle);
+  workers = new Worker[numWorkers];
+  for (int i = 0; i < numWorkers; i++){
+    workers[i].pool = this;
+    workers[i].index = i;
+    workers[i].seed = 2654435761u * (i + 1);
+  }
+  for (int i = 0; i < numWorkers; i++){
+    sthread_create(&workers[i].thread, workerMain, &workers[i]);
+  }
+}
+
+WorkPool::
+~WorkPool()
+{
+  shutdown();
+  delete[] workers;
+  scond_destroy(&idle);
+  smutex_destroy(&lock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * enqueue --
+ *
+ *      Submit a task to the pool. From one of our own workers the
+ *      task goes to that worker's deque; otherwise (or if the deque
+ *      is full) it goes to the injection queue.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void WorkPool::
+enqueue(Task task)
+{
+  Worker* self = (Worker*) currentWorker;
+  if (self != NULL && self->pool == this && self->deque.push(task)){
+    wakeWorker();
+    return;
+  }
+  smutex_lock(&lock);
+  injected.push_back(task);
+  numInjected.fetch_add(1);
+  if (sleepers.load() > 0){
+    scond_signal(&idle, &lock);
+  }
+  smutex_unlock(&lock);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * shutdown --
+ *
+ *      Let the workers finish every task that has been submitted,
+ *      then wait for them to exit. Nothing may be submitted after
+ *      this is called.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void WorkPool::
+shutdown()
+{
+  smutex_lock(&lock);
+  if (stopping){
+    smutex_unlock(&lock);
+    return;
+  }
+  stopping = true;
+  scond_broadcast(&idle, &lock);
+  smutex_unlock(&lock);
+  for (int i = 0; i < numWorkers; i++){
+    sthread_join(workers[i].thread);
+  }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * wakeWorker --
+ *
+ *      Called after making a task visible outside the lock. Wake
+ *      one parked worker, if any, so it can steal the task.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void WorkPool::
+wakeWorker()
+{
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleepers.load(std::memory_order_relaxed) > 0){
+    smutex_lock(&lock);
+    scond_signal(&idle, &lock);
+    smutex_unlock(&lock);
+  }
+}
+
+bool WorkPool::
+hasWork()
+{
+  if (numInjected.load() > 0){
+    return true;
+  }
+  for (int i = 0; i < numWorkers; i++){
+    if (!workers[i].deque.empty()){
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * takeInjected --
+ *
+ *      Take the task at the front of the injection queue and move up
+ *      to WORK_INJECT_BATCH - 1 more into our own deque, so the
+ *      queue lock is taken once per batch rather than once per task.
+ *
+ * Results:
+ *      True and the task in *task, or false if the queue is empty.
+ *
+ * ------------------------------------------------------------------
+ */
+bool WorkPool::
+takeInjected(Worker* self, Task* task)
+{
+  if (numInjected.load(std::memory_order_relaxed) == 0){
+    return false;
+  }
+  smutex_lock(&lock);
+  if (injected.empty()){
+    smutex_unlock(&lock);
+    return false;
+  }
+  *task = injected.front();
+  injected.pop_front();
+  int taken = 1;
+  while (taken < WORK_INJECT_BATCH && !injected.empty()
+         && self->deque.push(injected.front())){
+    injected.pop_front();
+    taken++;
+  }
+  numInjected.fetch_sub(taken);
+  if (taken > 1 && sleepers.load() > 0){
+    scond_signal(&idle, &lock);
+  }
+  smutex_unlock(&lock);
+  return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * stealTask --
+ *
+ *      Try to steal a task from each of the other workers, starting
+ *      at a random victim.
+ *
+ * Results:
+ *      True and the task in *task, or false if nothing was stolen.
+ *
+ * ------------------------------------------------------------------
+ */
+bool WorkPool::
+stealTask(Worker* self, Task* task)
+{
+  self->seed ^= self->seed << 13;
+  self->seed ^= self->seed >> 17;
+  self->seed ^= self->seed << 5;
+  int start = self->seed % numWorkers;
+  for (int i = 0; i < numWorkers; i++){
+    Worker* victim = &workers[(start + i) % numWorkers];
+    if (victim != self && victim->deque.steal(task)){
+      return true;
+    }
+  }
+  return false;
+}
+
+bool WorkPool::
+findTask(Worker* self, Task* task)
+{
+  return self->deque.take(task)
+      || takeInjected(self, task)
+      || stealTask(self, task);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * workerMain --
+ *
+ *      Body of a pool worker. Run tasks from our deque, the
+ *      injection queue or other workers until there are none left,
+ *      then park until more arrive. Exit once the pool is shutting
+ *      down and no work remains.
+ *
+ * Results:
+ *      Returns when the pool shuts down.
+ *
+ * ------------------------------------------------------------------
+ */
+void* WorkPool::
+workerMain(void* arg)
+{
+  Worker* self = (Worker*) arg;
+  WorkPool* pool = self->pool;
+  currentWorker = self;
+
+  Task task;
+  while (true){
+    if (pool->findTask(self, &task)){
+      bench_task_start(task);
+      task.run();
+      bench_task_done();
+      continue;
+    }
+    smutex_lock(&pool->lock);
+    pool->sleepers.fetch_add(1);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (!pool->stopping && !pool->hasWork()){
+      scond_wait(&pool->idle, &pool->lock);
+    }
+    pool->sleepers.fetch_sub(1);
+    bool done = pool->stopping && !pool->hasWork();
+    smutex_unlock(&pool->lock);
+    if (done){
+      break;
+    }
+  }
+  currentWorker = NULL;
+  return NULL;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <cstdint>
+
+#include "sthread.h"
+#include "Task.h"
+#include "TaskRing.h"
+
+#define WORK_DEQUE_CAPACITY 256
+#define WORK_INJECT_BATCH   16
+
+/*
+ * ------------------------------------------------------------------
+ * WorkDeque --
+ *
+ *      A fixed-capacity Chase-Lev work-stealing deque. The owning
+ *      worker pushes and takes at the bottom; other workers steal
+ *      from the top. Only a take that races a steal for the last
+ *      task, or two steals, ever contend (one CAS on top).
+ *
+ *      push fails when the deque is full instead of growing; the
+ *      caller keeps the task somewhere else.
+ *
+ * ------------------------------------------------------------------
+ */
+class WorkDeque {
+    private:
+    alignas(CACHE_LINE_SIZE) std::atomic<int64_t> top;
+    alignas(CACHE_LINE_SIZE) std::atomic<int64_t> bottom;
+    Task tasks[WORK_DEQUE_CAPACITY];
+
+    public:
+    WorkDeque();
+
+    bool push(const Task& task);
+    bool take(Task* task);
+    bool steal(Task* task);
+
+    bool empty() const;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * WorkPool --
+ *
+ *      A pool of worker threads that run Tasks from a shared
+ *      injection queue and from per-worker WorkDeques.
+ *
+ *      Tasks submitted from outside the pool (e.g. by the request
+ *      generators) go to the injection queue. A worker that pulls
+ *      from the injection queue takes a small batch, runs the first
+ *      task and leaves the rest in its own deque, where idle workers
+ *      can steal them. Tasks submitted by a worker go straight to
+ *      its own deque.
+ *
+ *      Any Task {handler, arg} can run here, but a handler must not
+ *      call sthread_exit; use shutdown instead. Handlers that block (buyItem) hold on to a
+ *      worker while they wait, so the pool must be large enough
+ *      that the tasks that unblock them can still run.
+ *
+ *      Task priorities are ignored: the injection queue and the
+ *      deques are plain FIFO/LIFO.
+ *
+ * ------------------------------------------------------------------
+ */
+class WorkPool : public TaskSink {
+    private:
+    struct Worker {
+        WorkPool* pool;
+        int index;
+        uint32_t seed;
+        sthread_t thread;
+        WorkDeque deque;
+    };
+
+    Worker* workers;
+    const int numWorkers;
+
+    smutex_t lock;
+    scond_t idle;
+    std::deque<Task> injected;
+    std::atomic<int> numInjected;
+    std::atomic<int> sleepers;
+    bool stopping;
+
+    static void* workerMain(void* arg);
+    bool findTask(Worker* self, Task* task);
+    bool takeInjected(Worker* self, Task* task);
+    bool stealTask(Worker* self, Task* task);
+    bool hasWork();
+    void wakeWorker();
+
+    public:
+    explicit WorkPool(int numWorkers);
+    ~WorkPool();
+
+    void enqueue(Task task);
+    void shutdown();
+};
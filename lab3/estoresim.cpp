@@ -4,21 +4,251 @@
 #include "EStore.h"
 #include "TaskQueue.h"
 #include "RequestGenerator.h"
+#include "WorkPool.h"
+#include "Log.h"
+#include "Bench.h"
+#include "Trace.h"
+
+// How many tasks a worker takes from its queue at a time, by default.
+#define WORKER_BATCH    8
+
+// The generators' pace outside benchmarks, by default: one request
+// per 100ms, so the suppliers stock the store while customers shop.
+#define DEMO_INTERVAL_US 100000
+
+/*
+ * ------------------------------------------------------------------
+ * SimOptions --
+ *
+ *      Everything main can configure about a run.
+ *
+ *      In benchmark mode (bench) every task is stamped when it is
+ *      enqueued, the store is closed once the suppliers are done so
+ *      no customer stays blocked, and the run ends with a report of
+ *      throughput and enqueue-to-completion latency.
+ *
+ *      The supplier and customer queues hold at most queueCapacity
+ *      tasks per priority lane, so the generators wait for the
+ *      workers instead of running ahead of them.
+ *
+ *      Workers take up to workerBatch tasks from their queue at a
+ *      time (see TaskQueue::dequeueMany). Customer workers take one
+ *      at a time when purchases can block (see purchasesCanBlock),
+ *      so a blocked purchase does not hold up the tasks taken with
+ *      it.
+ *
+ *      Unless fifo is set, restocks of items that customers are
+ *      waiting for jump the supplier queue (see
+ *      SupplierRequestGenerator::setPrioritizeRestocks).
+ *
+ *      With recordPath, every generated request is recorded in a
+ *      trace file there. With replayPath, the requests come from a
+ *      trace file instead of the random generators, as fast as the
+ *      queues take them or, with paced, at their recorded times.
+ *
+ *      With coro (coarse mode only), customers buy through
+ *      coroutines: a purchase that cannot be made yet is suspended
+ *      on the item instead of blocking a customer thread, and
+ *      completed by the supplier that makes it possible.
+ *
+ *      With batchSize above 1, each supplier task is a batch of
+ *      that many requests applied together (see EStore::applyBatch),
+ *      so supplierTasks counts batches.
+ *
+ *      With patienceNs set (not negative), customers give up on a
+ *      purchase they have waited that long for; orders then wait
+ *      whether or not waitForOrders is set.
+ *
+ *      With cancelWaits, each round's purchases share a CancelToken
+ *      that is cancelled once the round's supplier requests are
+ *      done: purchases still waiting then, or that would wait
+ *      later, give up as cancelled instead of waiting for restocks
+ *      that will not come. Not with coro or usePool.
+ *
+ *      iterations is how many rounds of the workload to run over
+ *      the same queues and threads (see startSimulation). It does
+ *      not combine with coro: a suspended purchase is not a task
+ *      the queues can drain, and could finish in a later round.
+ *      Purchases that wait need a patience or cancelWaits, so
+ *      every round ends.
+ *
+ *      placement, cpus and dedicatedCpus are passed on to
+ *      sthread_set_placement; the generators run on the dedicated
+ *      CPUs, if any.
+ *
+ * ------------------------------------------------------------------
+ */
+struct SimOptions {
+    int numSuppliers;
+    int numCustomers;
+    int supplierTasks;
+    int customerTasks;
+    int itemIdRange;
+    bool useFineMode;
+    bool waitForOrders;
+    bool optimistic;
+    TaskQueueBackend backend;
+    bool usePool;
+    bool heapTasks;
+    bool bench;
+    bool fifo;
+    bool coro;
+    long patienceNs;
+    bool cancelWaits;
+    int batchSize;
+    int iterations;
+    int placement;
+    const char* cpus;
+    int dedicatedCpus;
+    long interArrivalNs;
+    int queueCapacity;
+    int workerBatch;
+    const char* recordPath;
+    const char* replayPath;
+    bool paced;
+    bool seeded;
+    uint64_t seed;
+    int mix[NUM_SUPPLIER_REQUEST_TYPES];
+
+    SimOptions()
+        : numSuppliers(10), numCustomers(10),
+          supplierTasks(100), customerTasks(100),
+          itemIdRange(INVENTORY_SIZE),
+          useFineMode(false), waitForOrders(false), optimistic(false),
+          backend(TQ_LOCKED), usePool(false), heapTasks(false),
+          bench(false), fifo(false), coro(false),
+          patienceNs(PURCHASE_NO_TIMEOUT), cancelWaits(false),
+          batchSize(1), iterations(1),
+          placement(STHREAD_PLACE_NONE), cpus(NULL), dedicatedCpus(0),
+          interArrivalNs(0), queueCapacity(TASK_QUEUE_CAPACITY),
+          workerBatch(WORKER_BATCH),
+          recordPath(NULL), replayPath(NULL), paced(false),
+          seeded(false), seed(0)
+    {
+        for (int i = 0; i < NUM_SUPPLIER_REQUEST_TYPES; i++)
+            mix[i] = 1;
+    }
+};
+
+/*
+ * ------------------------------------------------------------------
+ * purchasesCanBlock --
+ *
+ *      Whether a customer task may block waiting on the store:
+ *      coarse-mode buyItem always can (unless it is a coroutine),
+ *      orders can with waitForOrders or a patience.
+ *
+ * Results:
+ *      True if customer tasks may block.
+ *
+ * ------------------------------------------------------------------
+ */
+static bool
+purchasesCanBlock(const SimOptions& opts)
+{
+  return !opts.coro
+      && (!opts.useFineMode || opts.waitForOrders || opts.patienceNs >= 0);
+}
 
 class Simulation
 {
     public:
+    SimOptions opts;
     TaskQueue supplierTasks;
     TaskQueue customerTasks;
     EStore store;
+    WorkPool* pool;
+    TraceWriter* trace;
+    std::vector<TraceRecord> replay[NUM_TRACE_SOURCES];
+    uint64_t replayStart;
+    int customerBatch;
+    std::atomic<long> generatorStalls;
+    CancelToken* cancel;
 
-    int maxTasks;
-    int numSuppliers;
-    int numCustomers;
+    Simulation(const SimOptions& options)
+        : opts(options),
+          supplierTasks(options.backend, options.queueCapacity),
+          customerTasks(options.backend, options.queueCapacity),
+          store(options.useFineMode, options.waitForOrders, options.optimistic),
+          pool(NULL), trace(NULL), replayStart(0),
+          customerBatch(purchasesCanBlock(options) ? 1 : options.workerBatch),
+          generatorStalls(0),
+          cancel(options.cancelWaits ? new CancelToken() : NULL) { }
+    ~Simulation() { delete cancel; }
 
-    explicit Simulation(bool useFineMode) : store(useFineMode) { }
+    /*
+     * Start a new round's token, once every purchase holding the
+     * old one is done.
+     */
+    void renewCancelToken()
+    {
+        if (cancel != NULL)
+        {
+            delete cancel;
+            cancel = new CancelToken();
+        }
+    }
 };
 
+/*
+ * ------------------------------------------------------------------
+ * configureGenerator --
+ *
+ *      Apply the simulation's request generation options to a
+ *      request generator. source tells the generators apart, so
+ *      each gets its own random sequence, repeatable with --seed,
+ *      and its own records in a trace.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+configureGenerator(RequestGenerator* gen, Simulation* simu, TraceSource source)
+{
+  gen->setItemIdRange(simu->opts.itemIdRange);
+  gen->setInlineTasks(!simu->opts.heapTasks);
+  gen->setInterArrival(simu->opts.interArrivalNs);
+  gen->setTimed(simu->opts.bench);
+  gen->setStream(source + 1);
+  gen->setTrace(simu->trace, source);
+  gen->setAsyncPurchases(simu->opts.coro);
+  gen->setPatience(simu->opts.patienceNs);
+  gen->setCancelToken(simu->cancel);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * replayTrace --
+ *
+ *      Enqueue the replayed requests of one trace source to its
+ *      queue (or to the pool). Used by the generator threads in
+ *      place of the random generators.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+replayTrace(Simulation* simu, TraceSource source)
+{
+  TaskSink* sink = simu->pool;
+  if (sink == NULL){
+    sink = source == TRACE_SUPPLIER ? &simu->supplierTasks : &simu->customerTasks;
+  }
+  ReplayRequestGenerator rrg(sink, simu->store.fineModeEnabled(),
+                             &simu->replay[source]);
+  configureGenerator(&rrg, simu, source);
+  rrg.setInterArrival(0);
+  if (simu->opts.paced){
+    rrg.setPacing(simu->replayStart);
+  }
+  rrg.enqueueTasks(rrg.recordCount(), &simu->store);
+  simu->generatorStalls += rrg.stallCount();
+}
+
 /*
  * ------------------------------------------------------------------
  * supplierGenerator --
@@ -26,13 +256,18 @@ class Simulation
  *      The supplier generator thread. The argument is a pointer to
  *      the shared Simulation object.
  *
- *      Enqueue arg->maxTasks requests to the supplier queue, then
- *      stop all supplier threads by enqueuing arg->numSuppliers
- *      stop requests.
+ *      Enqueue opts.supplierTasks requests (or, when replaying, the
+ *      trace's supplier requests) to the supplier queue. The
+ *      supplier threads are stopped by startSimulation, which
+ *      closes the queue.
  *
  *      Use a SupplierRequestGenerator to generate and enqueue
  *      requests.
  *
+ *      If the simulation runs on a WorkPool, enqueue the requests
+ *      into the pool instead; the pool is shut down by
+ *      startSimulation.
+ *
  *      This thread should exit when done.
  *
  * Results:
@@ -44,9 +279,27 @@ static void*
 supplierGenerator(void* arg)
 {
   Simulation *simu = (Simulation *) arg;
+  if (simu->opts.replayPath != NULL){
+    replayTrace(simu, TRACE_SUPPLIER);
+    sthread_exit();
+  }
+  if (simu->pool){
+    SupplierRequestGenerator srg(simu->pool);
+    configureGenerator(&srg, simu, TRACE_SUPPLIER);
+    srg.setRequestMix(simu->opts.mix);
+    srg.setPrioritizeRestocks(!simu->opts.fifo);
+    srg.setBatchSize(simu->opts.batchSize);
+    srg.enqueueTasks(simu->opts.supplierTasks, &simu->store);
+    simu->generatorStalls += srg.stallCount();
+    sthread_exit();
+  }
   SupplierRequestGenerator srg(&simu->supplierTasks) ;
-  srg.enqueueTasks(simu->maxTasks, &simu->store);
-  srg.enqueueStops(simu->numSuppliers);
+  configureGenerator(&srg, simu, TRACE_SUPPLIER);
+  srg.setRequestMix(simu->opts.mix);
+  srg.setPrioritizeRestocks(!simu->opts.fifo);
+  srg.setBatchSize(simu->opts.batchSize);
+  srg.enqueueTasks(simu->opts.supplierTasks, &simu->store);
+  simu->generatorStalls += srg.stallCount();
   sthread_exit();
     return NULL; // Keep compiler happy.
 }
@@ -58,9 +311,8 @@ supplierGenerator(void* arg)
  *      The customer generator thread. The argument is a pointer to
  *      the shared Simulation object.
  *
- *      Enqueue arg->maxTasks requests to the customer queue, then
- *      stop all customer threads by enqueuing arg->numCustomers
- *      stop requests.
+ *      Enqueue opts.customerTasks requests (or, when replaying, the
+ *      trace's customer requests) to the customer queue.
  *
  *      Use a CustomerRequestGenerator to generate and enqueue
  *      requests.  For the fineMode argument to the constructor
@@ -68,6 +320,9 @@ supplierGenerator(void* arg)
  *      store.fineModeEnabled() method, where store is a field
  *      in the Simulation class.
  *
+ *      As with supplierGenerator, a WorkPool simulation gets the
+ *      requests in the pool.
+ *
  *      This thread should exit when done.
  *
  * Results:
@@ -79,13 +334,52 @@ static void*
 customerGenerator(void* arg)
 {
   Simulation* simu = (Simulation *) arg;
+  if (simu->opts.replayPath != NULL){
+    replayTrace(simu, TRACE_CUSTOMER);
+    sthread_exit();
+  }
+  if (simu->pool){
+    CustomerRequestGenerator crg(simu->pool, simu->store.fineModeEnabled());
+    configureGenerator(&crg, simu, TRACE_CUSTOMER);
+    crg.enqueueTasks(simu->opts.customerTasks, &simu->store);
+    simu->generatorStalls += crg.stallCount();
+    sthread_exit();
+  }
   CustomerRequestGenerator crg(&simu->customerTasks, simu->store.fineModeEnabled());
-  crg.enqueueTasks(simu->maxTasks, &simu->store);
-  crg.enqueueStops(simu->numCustomers);
+  configureGenerator(&crg, simu, TRACE_CUSTOMER);
+  crg.enqueueTasks(simu->opts.customerTasks, &simu->store);
+  simu->generatorStalls += crg.stallCount();
   sthread_exit();
   return NULL; // Keep compiler happy.
 }
 
+/*
+ * ------------------------------------------------------------------
+ * runTasks --
+ *
+ *      The loop of a worker thread: take up to batch tasks at a time
+ *      from queue and run them, until the queue is closed and empty.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+runTasks(TaskQueue* queue, int batch)
+{
+  std::vector<Task> tasks(batch);
+  int n;
+  while ((n = queue->dequeueMany(tasks.data(), batch)) > 0){
+    for (int i = 0; i < n; i++){
+      bench_task_start(tasks[i]);
+      tasks[i].run();
+      bench_task_done();
+      queue->taskDone();
+    }
+  }
+}
+
 /*
  * ------------------------------------------------------------------
  * supplier --
@@ -93,22 +387,20 @@ customerGenerator(void* arg)
  *      The main supplier thread. The argument is a pointer to the
  *      shared Simulation object.
  *
- *      Dequeue Tasks from the supplier queue and execute them.
+ *      Dequeue Tasks from the supplier queue and execute them,
+ *      until the queue is closed and empty (see runTasks).
  *
  * Results:
- *      Does not return.
+ *      NULL.
  *
  * ------------------------------------------------------------------
  */
 static void*
 supplier(void* arg)
 {
-  while(true){
-    Simulation *simu = (Simulation *) arg;
-    Task task = simu->supplierTasks.dequeue();
-    task.handler(task.arg);
-  }
-     return NULL; // Keep compiler happy.
+  Simulation *simu = (Simulation *) arg;
+  runTasks(&simu->supplierTasks, simu->opts.workerBatch);
+  return NULL;
 }
 
 /*
@@ -118,22 +410,115 @@ supplier(void* arg)
  *      The main customer thread. The argument is a pointer to the
  *      shared Simulation object.
  *
- *      Dequeue Tasks from the customer queue and execute them.
+ *      Dequeue Tasks from the customer queue and execute them,
+ *      until the queue is closed and empty (see runTasks).
  *
  * Results:
- *      Does not return.
+ *      NULL.
  *
  * ------------------------------------------------------------------
  */
 static void*
 customer(void* arg)
 {
-  while(true){
-    Simulation *simu = (Simulation *) arg;
-    Task task = simu->customerTasks.dequeue();
-    task.handler(task.arg);
+  Simulation *simu = (Simulation *) arg;
+  runTasks(&simu->customerTasks, simu->customerBatch);
+  return NULL;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * reportBench --
+ *
+ *      Print the benchmark results for a run that took elapsed
+ *      nanoseconds.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static const char* placementNames[] = { "none", "pack", "spread" };
+
+static void
+reportBench(const SimOptions& opts, uint64_t elapsed)
+{
+  LatencySummary lat = bench_summary();
+  double seconds = elapsed / 1e9;
+  printf("BENCH mode=%s queue=%s placement=%s suppliers=%d customers=%d "
+         "tasks=%ld seconds=%.3f tasks/sec=%.0f\n",
+         opts.optimistic ? "occ" : (opts.useFineMode ? "fine" : "coarse"),
+         opts.usePool ? "pool" : (opts.backend == TQ_LOCKFREE ? "lockfree" : "locked"),
+         placementNames[opts.placement],
+         opts.numSuppliers, opts.numCustomers, lat.count,
+         seconds, lat.count / seconds);
+  printf("BENCH latency_us p50=%.1f p99=%.1f p999=%.1f max=%.1f\n",
+         lat.p50_us, lat.p99_us, lat.p999_us, lat.max_us);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * openTraces --
+ *
+ *      Load the trace to replay and create the trace to record, if
+ *      the options ask for them.
+ *
+ * Results:
+ *      True on success. On failure, print why to stderr and return
+ *      false.
+ *
+ * ------------------------------------------------------------------
+ */
+static bool
+openTraces(Simulation* simu)
+{
+  const SimOptions& opts = simu->opts;
+  if (opts.replayPath != NULL){
+    if (!trace_load(opts.replayPath, simu->replay)){
+      return false;
+    }
+    for (size_t i = 0; i < simu->replay[TRACE_CUSTOMER].size(); i++){
+      if (simu->replay[TRACE_CUSTOMER][i].type == TRACE_BUY_MANY_ITEMS &&
+          !opts.useFineMode){
+        fprintf(stderr, "%s: orders of several items can only be "
+                "replayed with --fine or --occ\n", opts.replayPath);
+        return false;
+      }
+    }
   }
-  return NULL; // Keep compiler happy.
+  if (opts.recordPath != NULL){
+    simu->trace = new TraceWriter();
+    if (!simu->trace->open(opts.recordPath)){
+      perror(opts.recordPath);
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * closeTrace --
+ *
+ *      Finish the trace being recorded, if any, once the generators
+ *      are done.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+closeTrace(Simulation* simu)
+{
+  if (simu->trace == NULL){
+    return;
+  }
+  simu->trace->close();
+  printf("Recorded %ld requests to %s\n",
+         simu->trace->recordCount(), simu->opts.recordPath);
+  delete simu->trace;
+  simu->trace = NULL;
 }
 
 /*
@@ -150,7 +535,25 @@ customer(void* arg)
  *
  *      After creating the worker threads, the main thread
  *      should wait until all of them exit, at which point it
- *      should return.
+ *      should return. Once a generator is done, its queue is
+ *      closed, so the workers exit when they have run every
+ *      request.
+ *
+ *      With opts.iterations > 1, the workload is generated that
+ *      many times over the same queues and worker threads: the
+ *      rounds before the last end with a drain of both queues (and
+ *      a benchmark report) instead of a shutdown.
+ *
+ *      With opts.cancelWaits, each round cancels its purchases'
+ *      token once its supplier requests are done, and the next
+ *      round gets a new one.
+ *
+ *      If usePool is set, the numSuppliers + numCustomers worker
+ *      threads form a single work-stealing WorkPool that runs both
+ *      kinds of request instead.
+ *
+ *      In benchmark mode, close the store once the suppliers are
+ *      done and report throughput and latency at the end.
  *
  *      Hint: Use sthread_join.
  *
@@ -160,19 +563,42 @@ customer(void* arg)
  * ------------------------------------------------------------------
  */
 static void
-startSimulation(int numSuppliers, int numCustomers, int maxTasks, bool useFineMode)
+startSimulation(const SimOptions& opts)
 {
   
-  Simulation *simu = new Simulation(useFineMode);
-  simu->maxTasks = maxTasks;
-  simu->numSuppliers = numSuppliers;
-  simu->numCustomers = numCustomers;
+  Simulation *simu = new Simulation(opts);
+  if (!openTraces(simu)){
+    exit(1);
+  }
+  int numSuppliers = opts.numSuppliers;
+  int numCustomers = opts.numCustomers;
+  uint64_t start = bench_now_ns();
+  simu->replayStart = sthread_now_ns();
 
-  sthread_t supplierT; 
-  sthread_t customerT; 
+  if (opts.usePool){
+    simu->pool = new WorkPool(numSuppliers + numCustomers);
+
+    sthread_t supplierT;
+    sthread_t customerT;
+    sthread_create_dedicated(&supplierT, supplierGenerator, simu);
+    sthread_create_dedicated(&customerT, customerGenerator, simu);
+    sthread_join(supplierT);
+    sthread_join(customerT);
+    if (opts.bench){
+      simu->store.close();
+    }
+    simu->pool->shutdown();
+    Printf("POOL RECYCLED");
+    log_stop();
+    closeTrace(simu);
+    if (opts.bench){
+      reportBench(opts, bench_now_ns() - start);
+    }
 
-  sthread_create(&supplierT, supplierGenerator, simu);
-  sthread_create(&customerT, customerGenerator, simu);
+    delete simu->pool;
+    delete simu;
+    return;
+  }
 
   sthread_t *stid = new sthread_t[numSuppliers];
   sthread_t *ctid = new sthread_t[numCustomers];
@@ -184,39 +610,357 @@ startSimulation(int numSuppliers, int numCustomers, int maxTasks, bool useFineMo
     sthread_create(&ctid[i], customer, simu);
   }
 
+  sthread_t supplierT; 
+  sthread_t customerT; 
+
+  for (int round = 1; round < opts.iterations; round++){
+    sthread_create_dedicated(&supplierT, supplierGenerator, simu);
+    sthread_create_dedicated(&customerT, customerGenerator, simu);
+    sthread_join(supplierT);
+    if (simu->cancel != NULL){
+      simu->supplierTasks.drain();
+      simu->cancel->cancel();
+    }
+    sthread_join(customerT);
+    simu->supplierTasks.drain();
+    simu->customerTasks.drain();
+    simu->renewCancelToken();
+    if (opts.bench){
+      reportBench(opts, bench_now_ns() - start);
+      bench_reset();
+    }
+    start = bench_now_ns();
+    simu->replayStart = sthread_now_ns();
+  }
+
+  sthread_create_dedicated(&supplierT, supplierGenerator, simu);
+  sthread_create_dedicated(&customerT, customerGenerator, simu);
 
   sthread_join(supplierT);
   Printf("Supplier generator Recycled");
-  sthread_join(customerT);
-  Printf("Customer Generator Recycled");
+  simu->supplierTasks.close();
   for (int i = 0; i < numSuppliers; i++){
     sthread_join(stid[i]);
   }
   Printf("NS RECYCLED");
-  fflush(stdout);
+  // With nothing left to restock the store, blocked customers could
+  // hold up the customer queue (and a bounded one, its generator)
+  // forever.
+  if (simu->cancel != NULL){
+    simu->cancel->cancel();
+  }
+  if (opts.bench){
+    simu->store.close();
+  }
+  sthread_join(customerT);
+  Printf("Customer Generator Recycled");
+  simu->customerTasks.close();
   for (int i = 0; i < numCustomers; i++){
     sthread_join(ctid[i]);
   }
   Printf("NC_RECYCLED");
-  fflush(stdout);
+  log_stop();
+  uint64_t elapsed = bench_now_ns() - start;
+
+  EStoreStats stats = simu->store.getStats();
+  printf("Blocked purchases: %ld waits, %ld wakeups, %ld spurious wakeups\n",
+         stats.waits, stats.wakeups, stats.spurious_wakeups);
+  printf("Blocked orders: %ld waits, %ld wakeups, %ld spurious wakeups\n",
+         stats.order_waits, stats.order_wakeups, stats.order_spurious_wakeups);
+  if (!opts.useFineMode){
+    printf("Lock-free purchases: %ld\n", stats.fast_buys);
+  }
+  if (opts.coro){
+    printf("Suspended purchases: %ld, at most %ld at once\n",
+           stats.async_waits, stats.async_peak);
+  }
+  printf("Generator stalls on full queues: %ld\n", simu->generatorStalls.load());
+  long total = 0;
+  for (int i = 0; i < NUM_PURCHASE_RESULTS; i++){
+    total += stats.purchases[i];
+  }
+  long abandoned = stats.purchases[PURCHASE_TIMED_OUT]
+                   + stats.purchases[PURCHASE_CANCELLED];
+  printf("Purchases: %ld bought, %ld removed, %ld declined, %ld timed out, "
+         "%ld cancelled (%.1f%% abandoned)\n",
+         stats.purchases[PURCHASE_BOUGHT], stats.purchases[PURCHASE_REMOVED],
+         stats.purchases[PURCHASE_DECLINED], stats.purchases[PURCHASE_TIMED_OUT],
+         stats.purchases[PURCHASE_CANCELLED],
+         total > 0 ? 100.0 * abandoned / total : 0.0);
+  if (opts.optimistic){
+    printf("Optimistic orders: %ld commits, %ld rejected without locking, "
+           "%ld conflicts, %ld fallbacks\n",
+           stats.occ_commits, stats.occ_rejects, stats.occ_conflicts,
+           stats.occ_fallbacks);
+  }
+  closeTrace(simu);
+  if (opts.bench){
+    reportBench(opts, elapsed);
+  }
 
   delete[] stid;
   delete[] ctid;
   delete simu;
 }
 
+/*
+ * ------------------------------------------------------------------
+ * parseMix --
+ *
+ *      Parse a comma-separated list of NUM_SUPPLIER_REQUEST_TYPES
+ *      weights (in SupplierRequestTypes order) into mix.
+ *
+ * Results:
+ *      True if the list is well formed and has a positive total.
+ *
+ * ------------------------------------------------------------------
+ */
+static bool
+parseMix(const char* arg, int* mix)
+{
+  int total = 0;
+  const char* p = arg;
+  for (int i = 0; i < NUM_SUPPLIER_REQUEST_TYPES; i++){
+    char* end;
+    long w = strtol(p, &end, 10);
+    if (end == p || w < 0){
+      return false;
+    }
+    mix[i] = (int) w;
+    total += mix[i];
+    if (i < NUM_SUPPLIER_REQUEST_TYPES - 1){
+      if (*end != ','){
+        return false;
+      }
+      p = end + 1;
+    } else if (*end != '\0'){
+      return false;
+    }
+  }
+  return total > 0;
+}
+
+static void
+usage(const char* prog)
+{
+  fprintf(stderr,
+          "usage: %s [--fine] [--occ] [--lockfree-queue] [--pool] [--wait-orders]\n"
+          "          [--heap-tasks] [--fifo] [--coro] [--placement none|pack|spread]\n"
+          "          [--cpus LIST] [--dedicated-cpus N] [--items N]\n"
+          "          [--log-level N] [--quiet] [--bench] [--suppliers N]\n"
+          "          [--customers N] [--tasks N]\n"
+          "          [--supplier-tasks N] [--customer-tasks N]\n"
+          "          [--interval-us N] [--patience-us N] [--cancel-waits]\n"
+          "          [--queue-capacity N]\n"
+          "          [--batch N] [--worker-batch N] [--iterations N] [--seed N]\n"
+          "          [--mix a,r,s,p,d,sh,sd] [--record FILE]\n"
+          "          [--replay FILE [--paced]]\n",
+          prog);
+}
+
 int main(int argc, char **argv)
 {
-    bool useFineMode = false;
+    SimOptions opts;
+    int logLevel = -1;
+    long intervalUs = -1;
+    long patienceUs = -1;
+
+    for (int i = 1; i < argc; i++)
+    {
+        bool hasValue = i + 1 < argc;
+        if (strcmp(argv[i], "--fine") == 0)
+            opts.useFineMode = true;
+        else if (strcmp(argv[i], "--occ") == 0)
+        {
+            opts.useFineMode = true;
+            opts.optimistic = true;
+        }
+        else if (strcmp(argv[i], "--lockfree-queue") == 0)
+            opts.backend = TQ_LOCKFREE;
+        else if (strcmp(argv[i], "--pool") == 0)
+            opts.usePool = true;
+        else if (strcmp(argv[i], "--wait-orders") == 0)
+            opts.waitForOrders = true;
+        else if (strcmp(argv[i], "--heap-tasks") == 0)
+            opts.heapTasks = true;
+        else if (strcmp(argv[i], "--fifo") == 0)
+            opts.fifo = true;
+        else if (strcmp(argv[i], "--coro") == 0)
+            opts.coro = true;
+        else if (strcmp(argv[i], "--placement") == 0 && hasValue)
+        {
+            i++;
+            opts.placement = -1;
+            for (int p = STHREAD_PLACE_NONE; p <= STHREAD_PLACE_SPREAD; p++)
+            {
+                if (strcmp(argv[i], placementNames[p]) == 0)
+                    opts.placement = p;
+            }
+            if (opts.placement < 0)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--cpus") == 0 && hasValue)
+            opts.cpus = argv[++i];
+        else if (strcmp(argv[i], "--dedicated-cpus") == 0 && hasValue)
+            opts.dedicatedCpus = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--items") == 0 && hasValue)
+            opts.itemIdRange = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--log-level") == 0 && hasValue)
+            logLevel = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--quiet") == 0)
+            logLevel = LOG_QUIET;
+        else if (strcmp(argv[i], "--bench") == 0)
+            opts.bench = true;
+        else if (strcmp(argv[i], "--suppliers") == 0 && hasValue)
+            opts.numSuppliers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--customers") == 0 && hasValue)
+            opts.numCustomers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--tasks") == 0 && hasValue)
+            opts.supplierTasks = opts.customerTasks = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--supplier-tasks") == 0 && hasValue)
+            opts.supplierTasks = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--customer-tasks") == 0 && hasValue)
+            opts.customerTasks = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--interval-us") == 0 && hasValue)
+            intervalUs = atol(argv[++i]);
+        else if (strcmp(argv[i], "--patience-us") == 0 && hasValue)
+            patienceUs = atol(argv[++i]);
+        else if (strcmp(argv[i], "--cancel-waits") == 0)
+            opts.cancelWaits = true;
+        else if (strcmp(argv[i], "--batch") == 0 && hasValue)
+            opts.batchSize = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--worker-batch") == 0 && hasValue)
+            opts.workerBatch = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--iterations") == 0 && hasValue)
+            opts.iterations = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--record") == 0 && hasValue)
+            opts.recordPath = argv[++i];
+        else if (strcmp(argv[i], "--replay") == 0 && hasValue)
+            opts.replayPath = argv[++i];
+        else if (strcmp(argv[i], "--paced") == 0)
+            opts.paced = true;
+        else if (strcmp(argv[i], "--queue-capacity") == 0 && hasValue)
+            opts.queueCapacity = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seed") == 0 && hasValue)
+        {
+            opts.seeded = true;
+            opts.seed = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--mix") == 0 && hasValue)
+        {
+            if (!parseMix(argv[++i], opts.mix))
+            {
+                fprintf(stderr, "--mix needs %d non-negative weights\n",
+                        NUM_SUPPLIER_REQUEST_TYPES);
+                return 1;
+            }
+        }
+        else
+        {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opts.itemIdRange <= 0)
+    {
+        fprintf(stderr, "--items must be positive\n");
+        return 1;
+    }
+    if (opts.numSuppliers <= 0 || opts.numCustomers <= 0 ||
+        opts.supplierTasks < 0 || opts.customerTasks < 0)
+    {
+        fprintf(stderr, "thread counts must be positive and task counts non-negative\n");
+        return 1;
+    }
+
+    if (opts.queueCapacity <= 0)
+    {
+        fprintf(stderr, "--queue-capacity must be positive\n");
+        return 1;
+    }
+    if (opts.coro && opts.useFineMode)
+    {
+        fprintf(stderr, "--coro only works in coarse mode\n");
+        return 1;
+    }
+    if (opts.coro && patienceUs >= 0)
+    {
+        fprintf(stderr, "--coro purchases cannot time out\n");
+        return 1;
+    }
+    if (opts.coro && opts.cancelWaits)
+    {
+        fprintf(stderr, "--coro purchases cannot be cancelled\n");
+        return 1;
+    }
+    if (opts.usePool && opts.cancelWaits)
+    {
+        fprintf(stderr, "--cancel-waits needs the task queues (no --pool)\n");
+        return 1;
+    }
+    if (opts.coro && opts.iterations > 1)
+    {
+        fprintf(stderr, "--coro purchases cannot be drained between --iterations\n");
+        return 1;
+    }
+    if (opts.workerBatch <= 0 || opts.workerBatch > TASK_QUEUE_CAPACITY)
+    {
+        fprintf(stderr, "--worker-batch must be between 1 and %d\n",
+                TASK_QUEUE_CAPACITY);
+        return 1;
+    }
+    if (opts.batchSize <= 0 || opts.batchSize > MAX_BATCH_OPS)
+    {
+        fprintf(stderr, "--batch must be between 1 and %d\n", MAX_BATCH_OPS);
+        return 1;
+    }
+    if (opts.iterations <= 0)
+    {
+        fprintf(stderr, "--iterations must be positive\n");
+        return 1;
+    }
+    // A round ends when its requests are done, so no purchase may
+    // wait for restocks that will never come.
+    bool purchasesWait = !opts.useFineMode || opts.waitForOrders;
+    if (opts.iterations > 1 &&
+        (opts.usePool || (purchasesWait && patienceUs < 0 && !opts.cancelWaits)))
+    {
+        fprintf(stderr, "--iterations needs the task queues (no --pool) and, "
+                "unless purchases never wait, --patience-us or --cancel-waits\n");
+        return 1;
+    }
 
-    // Seed the random number generator.
-    // You can remove this line or set it to some constant to get deterministic
-    // results, but make sure you put it back before turning in.
-    srand(time(NULL));
+    // A benchmark's generators run flat out, held back only by the
+    // bounded queues; other runs are paced like the original demo.
+    // --interval-us overrides either. A benchmark is also silent
+    // unless told otherwise.
+    if (intervalUs < 0 && !opts.bench)
+        intervalUs = DEMO_INTERVAL_US;
+    if (intervalUs >= 0)
+        opts.interArrivalNs = intervalUs * 1000;
+    if (patienceUs >= 0)
+        opts.patienceNs = patienceUs * 1000;
+    if (logLevel < 0)
+        logLevel = opts.bench ? LOG_QUIET : LOG_INFO;
+    // Seed the random number generator. Without --seed every run is
+    // different; with it, each generator's request sequence repeats.
+    sutil_seed(opts.seeded ? opts.seed : (uint64_t) time(NULL));
 
-    if (argc > 1)
-        useFineMode = strcmp(argv[1], "--fine") == 0;
-    startSimulation(10, 10, 100, useFineMode);
+    if ((opts.cpus != NULL || opts.dedicatedCpus > 0) &&
+        opts.placement == STHREAD_PLACE_NONE)
+        opts.placement = STHREAD_PLACE_PACK;
+    if (opts.dedicatedCpus < 0 ||
+        sthread_set_placement(opts.placement, opts.dedicatedCpus, opts.cpus) < 0)
+    {
+        fprintf(stderr, "bad --cpus list, or no CPU left for workers\n");
+        return 1;
+    }
+
+    log_set_level(logLevel);
+    log_start();
+    startSimulation(opts);
     return 0;
 }
-
@@ -0,0 +1,127 @@
+/*
+ * queuetest --
+ *
+ *      Tests for the non-blocking and timed TaskQueue dequeues
+ *      (tryDequeue and dequeueFor), run against both backends:
+ *
+ *          empty   - neither takes a task from an empty queue, and
+ *                    dequeueFor(0) does not wait.
+ *          timeout - dequeueFor on an empty queue gives up after
+ *                    its timeout, and returns a task enqueued by
+ *                    another thread before the timeout.
+ *          closed  - a closed queue still hands out the tasks left
+ *                    in it, then both fail at once, however long
+ *                    the timeout.
+ *
+ *      usage: queuetest
+ *      Prints each failed check and exits non-zero if any failed.
+ */
+#include <cstdio>
+
+#include "TaskQueue.h"
+
+#define MS 1000000ULL
+
+static int failures = 0;
+static const char* backendName = "";
+
+#define CHECK(cond)                                                     \
+  do {                                                                  \
+    if (!(cond)){                                                       \
+      printf("%s: %s:%d: check failed: %s\n", backendName, __FILE__,   \
+             __LINE__, #cond);                                          \
+      failures++;                                                       \
+    }                                                                   \
+  } while (0)
+
+static Task
+markedTask(long mark)
+{
+  Task task;
+  task.arg = (void*) mark;
+  return task;
+}
+
+static void
+testEmpty(TaskQueueBackend backend)
+{
+  TaskQueue queue(backend, 4);
+  Task task;
+  CHECK(!queue.tryDequeue(&task));
+  uint64_t start = sthread_now_ns();
+  CHECK(!queue.dequeueFor(&task, 0));
+  CHECK(sthread_now_ns() - start < 100 * MS);
+
+  queue.enqueue(markedTask(1));
+  CHECK(queue.tryDequeue(&task) && task.arg == (void*) 1);
+  queue.taskDone();
+  CHECK(!queue.tryDequeue(&task));
+  queue.enqueue(markedTask(2));
+  CHECK(queue.dequeueFor(&task, 0) && task.arg == (void*) 2);
+  queue.taskDone();
+}
+
+struct LateEnqueue {
+  TaskQueue* queue;
+  uint64_t delayNs;
+};
+
+static void*
+lateEnqueue(void* arg)
+{
+  LateEnqueue* late = (LateEnqueue*) arg;
+  sthread_sleep(0, late->delayNs);
+  late->queue->enqueue(markedTask(3));
+  return NULL;
+}
+
+static void
+testTimeout(TaskQueueBackend backend)
+{
+  TaskQueue queue(backend, 4);
+  Task task;
+  uint64_t start = sthread_now_ns();
+  CHECK(!queue.dequeueFor(&task, 20 * MS));
+  CHECK(sthread_now_ns() - start >= 20 * MS);
+
+  LateEnqueue late = { &queue, 10 * MS };
+  sthread_t t;
+  sthread_create(&t, lateEnqueue, &late);
+  start = sthread_now_ns();
+  CHECK(queue.dequeueFor(&task, 5000 * MS) && task.arg == (void*) 3);
+  CHECK(sthread_now_ns() - start < 5000 * MS);
+  queue.taskDone();
+  sthread_join(t);
+}
+
+static void
+testClosed(TaskQueueBackend backend)
+{
+  TaskQueue queue(backend, 4);
+  Task task;
+  queue.enqueue(markedTask(4));
+  queue.enqueue(markedTask(5));
+  queue.close();
+  CHECK(queue.tryDequeue(&task) && task.arg == (void*) 4);
+  queue.taskDone();
+  CHECK(queue.dequeueFor(&task, 5000 * MS) && task.arg == (void*) 5);
+  queue.taskDone();
+  CHECK(!queue.tryDequeue(&task));
+  uint64_t start = sthread_now_ns();
+  CHECK(!queue.dequeueFor(&task, 5000 * MS));
+  CHECK(sthread_now_ns() - start < 100 * MS);
+}
+
+int main(int argc, char **argv)
+{
+  static const TaskQueueBackend backends[] = { TQ_LOCKED, TQ_LOCKFREE };
+  static const char* names[] = { "locked", "lockfree" };
+  for (int b = 0; b < 2; b++){
+    backendName = names[b];
+    testEmpty(backends[b]);
+    testTimeout(backends[b]);
+    testClosed(backends[b]);
+  }
+  printf("queuetest: %s\n", failures == 0 ? "all passed" : "FAILED");
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,161 @@
+/*
+ * quotebench --
+ *
+ *      Microbenchmark for EStore::quote under concurrent price
+ *      changes.
+ *
+ *      A fine-mode store is filled with INVENTORY_SIZE items. Two
+ *      supplier threads keep changing item prices and discounts and
+ *      the shipping cost while 1, 2, 4, ... reader threads each
+ *      quote a fixed number of random baskets of QUOTE_ITEMS items.
+ *      Quotes take no lock, so readers should scale with their
+ *      number (up to the number of CPUs) instead of queueing behind
+ *      each other and the suppliers.
+ *
+ *      usage: quotebench [max readers] [quotes per reader]
+ */
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include "EStore.h"
+
+#define QUOTE_ITEMS     5
+#define NUM_SUPPLIERS   2
+
+struct Worker {
+    EStore* store;
+    int index;
+    int iterations;
+    std::atomic<bool>* stop;
+    long quoted;
+};
+
+static unsigned
+next_random(unsigned* seed)
+{
+  *seed ^= *seed << 13;
+  *seed ^= *seed >> 17;
+  *seed ^= *seed << 5;
+  return *seed;
+}
+
+static void*
+supplier(void* arg)
+{
+  Worker* w = (Worker*) arg;
+  unsigned seed = 2654435761u * (w->index + 1);
+  for (long i = 0; !w->stop->load(std::memory_order_relaxed); i++){
+    int id = next_random(&seed) % INVENTORY_SIZE;
+    switch (i % 3){
+      case 0:
+        w->store->priceItem(id, 1 + next_random(&seed) % 100);
+        break;
+      case 1:
+        w->store->discountItem(id, (next_random(&seed) % 50) / 100.0);
+        break;
+      default:
+        w->store->setShippingCost(next_random(&seed) % 10);
+        break;
+    }
+  }
+  return NULL;
+}
+
+static void*
+reader(void* arg)
+{
+  Worker* w = (Worker*) arg;
+  unsigned seed = 40503u * (w->index + 1);
+  int ids[QUOTE_ITEMS];
+  Quote quote;
+  w->quoted = 0;
+  for (int i = 0; i < w->iterations; i++){
+    for (int j = 0; j < QUOTE_ITEMS; j++){
+      ids[j] = next_random(&seed) % INVENTORY_SIZE;
+    }
+    if (w->store->quote(std::span<const int>(ids, QUOTE_ITEMS), &quote)){
+      w->quoted++;
+    }
+  }
+  return NULL;
+}
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Run readers reader threads against the suppliers and return the
+ * total number of quotes per second.
+ */
+static double
+run(EStore* store, int readers, int iterations)
+{
+  std::atomic<bool> stop(false);
+  sthread_t suppliers[NUM_SUPPLIERS];
+  Worker supplierArgs[NUM_SUPPLIERS];
+  for (int t = 0; t < NUM_SUPPLIERS; t++){
+    supplierArgs[t].store = store;
+    supplierArgs[t].index = t;
+    supplierArgs[t].stop = &stop;
+    sthread_create(&suppliers[t], supplier, &supplierArgs[t]);
+  }
+
+  sthread_t* tids = new sthread_t[readers];
+  Worker* args = new Worker[readers];
+  double start = now();
+  for (int t = 0; t < readers; t++){
+    args[t].store = store;
+    args[t].index = t;
+    args[t].iterations = iterations;
+    sthread_create(&tids[t], reader, &args[t]);
+  }
+  long quoted = 0;
+  for (int t = 0; t < readers; t++){
+    sthread_join(tids[t]);
+    quoted += args[t].quoted;
+  }
+  double elapsed = now() - start;
+
+  stop.store(true);
+  for (int t = 0; t < NUM_SUPPLIERS; t++){
+    sthread_join(suppliers[t]);
+  }
+  if (quoted != (long) readers * iterations){
+    fprintf(stderr, "quote failed for a carried item\n");
+    exit(1);
+  }
+  delete[] args;
+  delete[] tids;
+  return readers * iterations / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+  int maxReaders = argc > 1 ? atoi(argv[1]) : 8;
+  int iterations = argc > 2 ? atoi(argv[2]) : 200000;
+  if (maxReaders < 1 || iterations < 1){
+    fprintf(stderr, "usage: %s [max readers] [quotes per reader]\n", argv[0]);
+    return 1;
+  }
+
+  EStore store(true);
+  for (int id = 0; id < INVENTORY_SIZE; id++){
+    store.addItem(id, 10, 1 + id % 100, 0);
+  }
+
+  printf("%d suppliers, %d quotes of %d items per reader\n",
+         NUM_SUPPLIERS, iterations, QUOTE_ITEMS);
+  printf("%-8s %14s %14s\n", "readers", "quotes/sec", "per reader");
+  for (int readers = 1; readers <= maxReaders; readers *= 2){
+    double rate = run(&store, readers, iterations);
+    printf("%-8d %14.0f %14.0f\n", readers, rate, rate / readers);
+  }
+  return 0;
+}
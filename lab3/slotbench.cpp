@@ -0,0 +1,132 @@
+/*
+ * slotbench --
+ *
+ *      Microbenchmark for false sharing between fine-mode item
+ *      updates.
+ *
+ *      Each thread repeatedly locks an item, updates it and unlocks
+ *      it, like EStore::addStock does in fine mode. We compare the
+ *      old store layout (a packed Item array next to a separate
+ *      smutex_t array) with the ItemSlot layout EStore uses now, for
+ *      two access patterns:
+ *
+ *          adjacent - thread t always updates item t, so no two
+ *                     threads ever touch the same item, but their
+ *                     items and locks are neighbours in memory.
+ *          random   - every update picks a random item.
+ *
+ *      usage: slotbench [threads] [iterations per thread]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+#include "EStore.h"
+
+struct PackedLayout {
+    Item inventory[INVENTORY_SIZE];
+    smutex_t locks[INVENTORY_SIZE];
+
+    Item* item(int id) { return &inventory[id]; }
+    smutex_t* lock(int id) { return &locks[id]; }
+};
+
+struct SlotLayout {
+    ItemSlot slots[INVENTORY_SIZE];
+
+    Item* item(int id) { return &slots[id].item; }
+    smutex_t* lock(int id) { return &slots[id].lock; }
+};
+
+template <class Layout>
+struct Bench {
+    Layout* layout;
+    int index;
+    int iterations;
+    bool adjacent;
+};
+
+template <class Layout>
+static void*
+worker(void* arg)
+{
+  Bench<Layout>* b = (Bench<Layout>*) arg;
+  unsigned seed = 2654435761u * (b->index + 1);
+  for (int i = 0; i < b->iterations; i++){
+    int id = b->index;
+    if (!b->adjacent){
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+      id = seed % INVENTORY_SIZE;
+    }
+    smutex_lock(b->layout->lock(id));
+    Item* item = b->layout->item(id);
+    item->quantity++;
+    item->price += 1;
+    smutex_unlock(b->layout->lock(id));
+  }
+  return NULL;
+}
+
+static double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+template <class Layout>
+static double
+run(int threads, int iterations, bool adjacent)
+{
+  Layout* layout = new Layout();
+  for (int i = 0; i < INVENTORY_SIZE; i++){
+    smutex_init(layout->lock(i));
+  }
+
+  sthread_t* tids = new sthread_t[threads];
+  Bench<Layout>* args = new Bench<Layout>[threads];
+  double start = now();
+  for (int t = 0; t < threads; t++){
+    args[t].layout = layout;
+    args[t].index = t;
+    args[t].iterations = iterations;
+    args[t].adjacent = adjacent;
+    sthread_create(&tids[t], worker<Layout>, &args[t]);
+  }
+  for (int t = 0; t < threads; t++){
+    sthread_join(tids[t]);
+  }
+  double elapsed = now() - start;
+
+  for (int i = 0; i < INVENTORY_SIZE; i++){
+    smutex_destroy(layout->lock(i));
+  }
+  delete[] args;
+  delete[] tids;
+  delete layout;
+  return elapsed * 1e9 / ((double) threads * iterations);
+}
+
+int main(int argc, char **argv)
+{
+  int threads = argc > 1 ? atoi(argv[1]) : 4;
+  int iterations = argc > 2 ? atoi(argv[2]) : 1000000;
+  if (threads < 1 || threads > INVENTORY_SIZE || iterations < 1){
+    fprintf(stderr, "usage: %s [threads (1-%d)] [iterations]\n",
+            argv[0], INVENTORY_SIZE);
+    return 1;
+  }
+
+  printf("%d threads, %d updates each, ns per update\n", threads, iterations);
+  printf("%-8s %10s %10s\n", "layout", "adjacent", "random");
+  printf("%-8s %10.1f %10.1f\n", "packed",
+         run<PackedLayout>(threads, iterations, true),
+         run<PackedLayout>(threads, iterations, false));
+  printf("%-8s %10.1f %10.1f\n", "slots",
+         run<SlotLayout>(threads, iterations, true),
+         run<SlotLayout>(threads, iterations, false));
+  return 0;
+}
@@ -8,6 +8,239 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <sched.h>
+#include <algorithm>
+#include <vector>
+
+static struct timespec
+to_timespec(uint64_t ns)
+{
+  struct timespec ts;
+  ts.tv_sec = ns / 1000000000;
+  ts.tv_nsec = ns % 1000000000;
+  return ts;
+}
+
+#if !defined(STHREAD_FUTEX)
+/*
+ * Initialize cond to measure scond_timedwait deadlines on
+ * CLOCK_MONOTONIC, like sthread_now_ns.
+ */
+static void
+cond_init_monotonic(pthread_cond_t *cond)
+{
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  if(pthread_cond_init(cond, &attr)){
+      perror("pthread_cond_init failed");
+      exit(-1);
+  }
+  pthread_condattr_destroy(&attr);
+}
+#endif
+
+#if defined(STHREAD_FUTEX)
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/*
+ * Sleep on *addr as long as it still holds val, until deadline (a
+ * CLOCK_MONOTONIC time) if one is given.
+ *
+ * Returns false if the deadline passed.
+ */
+static bool
+futex_wait(int *addr, int val, const struct timespec *deadline = NULL)
+{
+  if(syscall(SYS_futex, addr, FUTEX_WAIT_BITSET_PRIVATE, val, deadline,
+             NULL, FUTEX_BITSET_MATCH_ANY) == -1){
+    if(errno == ETIMEDOUT){
+      return false;
+    }
+    if(errno != EAGAIN && errno != EINTR){
+      perror("futex wait failed");
+      exit(-1);
+    }
+  }
+  return true;
+}
+
+static void
+futex_wake(int *addr, int count)
+{
+  if(syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0) == -1){
+    perror("futex wake failed");
+    exit(-1);
+  }
+}
+
+/*
+ * Wake one thread sleeping on *addr and move the others to sleep on
+ * *to instead, provided *addr still holds val.
+ *
+ * Returns false if *addr changed in the meantime.
+ */
+static bool
+futex_requeue(int *addr, int val, int *to)
+{
+  if(syscall(SYS_futex, addr, FUTEX_CMP_REQUEUE_PRIVATE, 1,
+             (void *) (long) INT_MAX, to, val) == -1){
+    if(errno == EAGAIN){
+      return false;
+    }
+    perror("futex requeue failed");
+    exit(-1);
+  }
+  return true;
+}
+
+void smutex_init(smutex_t *mutex)
+{
+  mutex->state = 0;
+  mutex->spins = 0;
+}
+
+void smutex_destroy(smutex_t *mutex)
+{
+  assert(__atomic_load_n(&mutex->state, __ATOMIC_RELAXED) == 0);
+}
+
+/*
+ * Take the mutex, and mark it contended so that whoever unlocks it
+ * next wakes a sleeper. Used once a thread has decided to sleep, and
+ * by waiters returning from scond_wait, which may have had company
+ * requeued onto the mutex.
+ */
+static void
+lock_contended(smutex_t *mutex)
+{
+  while(__atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE) != 0){
+    futex_wait(&mutex->state, 2);
+  }
+}
+
+static bool
+try_lock(smutex_t *mutex)
+{
+  int unlocked = 0;
+  return __atomic_compare_exchange_n(&mutex->state, &unlocked, 1, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void smutex_lock(smutex_t *mutex)
+{
+  if(try_lock(mutex)){
+    return;
+  }
+
+  // Spin for up to about twice as long as recent acquisitions had
+  // to, then move the estimate an eighth of the way towards this
+  // one (counting a spin that gave up as the full limit).
+  int spins = __atomic_load_n(&mutex->spins, __ATOMIC_RELAXED);
+  int limit = spins * 2 + 10;
+  if(limit > SMUTEX_MAX_SPIN){
+    limit = SMUTEX_MAX_SPIN;
+  }
+  int n;
+  bool locked = false;
+  for(n = 0; n < limit; n++){
+    cpu_relax();
+    if(__atomic_load_n(&mutex->state, __ATOMIC_RELAXED) == 0 &&
+       try_lock(mutex)){
+      locked = true;
+      break;
+    }
+  }
+  __atomic_store_n(&mutex->spins, spins + (n - spins) / 8, __ATOMIC_RELAXED);
+
+  if(!locked){
+    lock_contended(mutex);
+  }
+}
+
+void smutex_unlock(smutex_t *mutex)
+{
+  if(__atomic_exchange_n(&mutex->state, 0, __ATOMIC_RELEASE) == 2){
+    futex_wake(&mutex->state, 1);
+  }
+}
+
+
+
+void scond_init(scond_t *cond)
+{
+  cond->seq = 0;
+  cond->waiters = 0;
+}
+
+void scond_destroy(scond_t *cond __attribute__((unused)))
+{
+  assert(cond->waiters == 0);
+}
+
+void scond_signal(scond_t *cond, smutex_t *mutex __attribute__((unused)))
+{
+  //
+  // assert(mutex is held by this thread);
+  //
+  if(cond->waiters == 0){
+    return;
+  }
+  __atomic_fetch_add(&cond->seq, 1, __ATOMIC_SEQ_CST);
+  futex_wake(&cond->seq, 1);
+}
+
+void scond_broadcast(scond_t *cond, smutex_t *mutex)
+{
+  //
+  // assert(mutex is held by this thread);
+  //
+  if(cond->waiters == 0){
+    return;
+  }
+  int seq = __atomic_add_fetch(&cond->seq, 1, __ATOMIC_SEQ_CST);
+
+  // The requeued waiters only get woken by an unlock that sees the
+  // mutex contended, so mark it so. If the caller does not actually
+  // hold the mutex, or the sequence moved on under us, wake everyone
+  // the plain way.
+  int held = 1;
+  __atomic_compare_exchange_n(&mutex->state, &held, 2, false,
+                              __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  if(held == 0 || !futex_requeue(&cond->seq, seq, &mutex->state)){
+    futex_wake(&cond->seq, INT_MAX);
+  }
+}
+
+void scond_wait(scond_t *cond, smutex_t *mutex)
+{
+  //
+  // assert(mutex is held by this thread);
+  //
+  int seq = __atomic_load_n(&cond->seq, __ATOMIC_RELAXED);
+  cond->waiters++;
+  smutex_unlock(mutex);
+  futex_wait(&cond->seq, seq);
+  lock_contended(mutex);
+  cond->waiters--;
+}
+
+bool scond_timedwait(scond_t *cond, smutex_t *mutex, uint64_t deadline)
+{
+  struct timespec ts = to_timespec(deadline);
+  int seq = __atomic_load_n(&cond->seq, __ATOMIC_RELAXED);
+  cond->waiters++;
+  smutex_unlock(mutex);
+  bool woken = futex_wait(&cond->seq, seq, &ts);
+  lock_contended(mutex);
+  cond->waiters--;
+  return woken;
+}
+
+#elif !defined(STHREAD_PROFILE)
 
 void smutex_init(smutex_t *mutex)
 {
@@ -45,10 +278,7 @@ void smutex_unlock(smutex_t *mutex)
 
 void scond_init(scond_t *cond)
 {
-  if(pthread_cond_init(cond, NULL)){
-      perror("pthread_cond_init failed");
-      exit(-1);
-  }
+  cond_init_monotonic(cond);
 }
 
 void scond_destroy(scond_t *cond)
@@ -94,7 +324,516 @@ void scond_wait(scond_t *cond, smutex_t *mutex)
   }
 }
 
+bool scond_timedwait(scond_t *cond, smutex_t *mutex, uint64_t deadline)
+{
+  struct timespec ts = to_timespec(deadline);
+  int err = pthread_cond_timedwait(cond, mutex, &ts);
+  if(err == ETIMEDOUT){
+    return false;
+  }
+  if(err){
+    perror("pthread_cond_timedwait failed");
+    exit(-1);
+  }
+  return true;
+}
+
+#else /* STHREAD_PROFILE */
+
+#include <string.h>
+
+static sthread_site_t *sites = NULL;
+static sthread_site_t staticMutexSite =
+  { "(static initializer)", 0, "", STHREAD_SITE_MUTEX };
+static sthread_site_t unknownCondSite =
+  { "(not initialized)", 0, "", STHREAD_SITE_COND };
+
+/*
+ * The condition variable this thread last returned from waiting
+ * on, as long as it has not unlocked a mutex since.
+ */
+static __thread scond_t *lastWoken = NULL;
+
+static unsigned long long
+now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void
+add(unsigned long *counter, unsigned long n)
+{
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static void
+add_time(unsigned long long *total, unsigned long long *max,
+         unsigned long long ns)
+{
+  __atomic_fetch_add(total, ns, __ATOMIC_RELAXED);
+  unsigned long long cur = __atomic_load_n(max, __ATOMIC_RELAXED);
+  while (ns > cur &&
+         !__atomic_compare_exchange_n(max, &cur, ns, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+  }
+}
+
+static void report();
 
+/*
+ * Link site into the list the report walks, the first time it is
+ * used.
+ */
+static sthread_site_t *
+enlist(sthread_site_t *site)
+{
+  if (__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE)){
+    return site;
+  }
+  int expected = 0;
+  if (!__atomic_compare_exchange_n(&site->registered, &expected, 1, false,
+                                   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+    return site;
+  }
+  sthread_site_t *head = __atomic_load_n(&sites, __ATOMIC_RELAXED);
+  do {
+    site->next = head;
+  } while (!__atomic_compare_exchange_n(&sites, &head, site, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  static int reporting = 0;
+  if (!__atomic_exchange_n(&reporting, 1, __ATOMIC_ACQ_REL)){
+    atexit(report);
+  }
+  return site;
+}
+
+static sthread_site_t *
+mutex_site(smutex_t *mutex)
+{
+  return enlist(mutex->site != NULL ? mutex->site : &staticMutexSite);
+}
+
+static sthread_site_t *
+cond_site(scond_t *cond)
+{
+  return enlist(cond->site != NULL ? cond->site : &unknownCondSite);
+}
+
+void smutex_init_at(smutex_t *mutex, sthread_site_t *site)
+{
+  if(pthread_mutex_init(&mutex->mutex, NULL)){
+      perror("pthread_mutex_init failed");
+      exit(-1);
+  }
+  mutex->site = site;
+  mutex->held_at = NULL;
+  mutex->acquired_ns = 0;
+}
+
+void smutex_destroy(smutex_t *mutex)
+{
+  if(pthread_mutex_destroy(&mutex->mutex)){
+      perror("pthread_mutex_destroy failed");
+      exit(-1);
+  }
+}
+
+void smutex_lock_at(smutex_t *mutex, sthread_site_t *site)
+{
+  sthread_site_t *msite = mutex_site(mutex);
+  enlist(site);
+
+  int err = pthread_mutex_trylock(&mutex->mutex);
+  unsigned long long start = now_ns();
+  if (err == EBUSY){
+    err = pthread_mutex_lock(&mutex->mutex);
+    unsigned long long waited = now_ns() - start;
+    start += waited;
+    add(&msite->contended, 1);
+    add(&site->contended, 1);
+    add_time(&msite->wait_ns, &msite->max_wait_ns, waited);
+    add_time(&site->wait_ns, &site->max_wait_ns, waited);
+  }
+  if (err){
+    perror("pthread_mutex_lock failed");
+    exit(-1);
+  }
+  add(&msite->acquisitions, 1);
+  add(&site->acquisitions, 1);
+  mutex->held_at = site;
+  mutex->acquired_ns = start;
+}
+
+/*
+ * Charge the time since the holder locked mutex to the mutex and
+ * to the site that locked it.
+ */
+static void
+end_hold(smutex_t *mutex)
+{
+  unsigned long long held = now_ns() - mutex->acquired_ns;
+  sthread_site_t *msite = mutex_site(mutex);
+  add_time(&msite->hold_ns, &msite->max_hold_ns, held);
+  if (mutex->held_at != NULL){
+    add_time(&mutex->held_at->hold_ns, &mutex->held_at->max_hold_ns, held);
+  }
+}
+
+void smutex_unlock(smutex_t *mutex)
+{
+  end_hold(mutex);
+  lastWoken = NULL;
+  if(pthread_mutex_unlock(&mutex->mutex)){
+    perror("pthread_mutex_unlock failed");
+    exit(-1);
+  }
+}
+
+void scond_init_at(scond_t *cond, sthread_site_t *site)
+{
+  cond_init_monotonic(&cond->cond);
+  cond->site = site;
+}
+
+void scond_destroy(scond_t *cond)
+{
+  if(pthread_cond_destroy(&cond->cond)){
+      perror("pthread_cond_destroy failed");
+      exit(-1);
+  }
+}
+
+void scond_signal(scond_t *cond, smutex_t *mutex __attribute__((unused)))
+{
+  add(&cond_site(cond)->signals, 1);
+  if(pthread_cond_signal(&cond->cond)){
+    perror("pthread_cond_signal failed");
+    exit(-1);
+  }
+}
+
+void scond_broadcast(scond_t *cond, smutex_t *mutex __attribute__((unused)))
+{
+  add(&cond_site(cond)->broadcasts, 1);
+  if(pthread_cond_broadcast(&cond->cond)){
+    perror("pthread_cond_broadcast failed");
+    exit(-1);
+  }
+}
+
+void scond_wait_at(scond_t *cond, smutex_t *mutex, sthread_site_t *site)
+{
+  sthread_site_t *csite = cond_site(cond);
+  enlist(site);
+
+  add(&csite->waits, 1);
+  add(&site->waits, 1);
+  if (lastWoken == cond){
+    add(&csite->spurious, 1);
+    add(&site->spurious, 1);
+  }
+
+  // The mutex is released while we sleep: close the current hold
+  // and start a new one when we get it back.
+  sthread_site_t *heldAt = mutex->held_at;
+  end_hold(mutex);
+  if(pthread_cond_wait(&cond->cond, &mutex->mutex)){
+    perror("pthread_cond_wait failed");
+    exit(-1);
+  }
+  mutex->held_at = heldAt;
+  mutex->acquired_ns = now_ns();
+
+  add(&csite->wakeups, 1);
+  add(&site->wakeups, 1);
+  lastWoken = cond;
+}
+
+bool scond_timedwait_at(scond_t *cond, smutex_t *mutex, uint64_t deadline,
+                        sthread_site_t *site)
+{
+  sthread_site_t *csite = cond_site(cond);
+  enlist(site);
+
+  add(&csite->waits, 1);
+  add(&site->waits, 1);
+  if (lastWoken == cond){
+    add(&csite->spurious, 1);
+    add(&site->spurious, 1);
+  }
+
+  sthread_site_t *heldAt = mutex->held_at;
+  end_hold(mutex);
+  struct timespec ts = to_timespec(deadline);
+  int err = pthread_cond_timedwait(&cond->cond, &mutex->mutex, &ts);
+  if(err && err != ETIMEDOUT){
+    perror("pthread_cond_timedwait failed");
+    exit(-1);
+  }
+  mutex->held_at = heldAt;
+  mutex->acquired_ns = now_ns();
+
+  // A timeout is not a wakeup, but the caller will still re-check
+  // its predicate, so it may lead to a spurious wait like one.
+  if(err == 0){
+    add(&csite->wakeups, 1);
+    add(&site->wakeups, 1);
+  }
+  lastWoken = cond;
+  return err == 0;
+}
+
+static bool
+by_wait_time(const sthread_site_t *a, const sthread_site_t *b)
+{
+  if (a->wait_ns != b->wait_ns){
+    return a->wait_ns > b->wait_ns;
+  }
+  return a->hold_ns > b->hold_ns;
+}
+
+static bool
+by_waits(const sthread_site_t *a, const sthread_site_t *b)
+{
+  return a->waits > b->waits;
+}
+
+static void
+report_locks(const char *title, std::vector<sthread_site_t *> &v)
+{
+  std::sort(v.begin(), v.end(), by_wait_time);
+  fprintf(stderr, "\n%s\n", title);
+  fprintf(stderr, "%-44s %10s %10s %12s %10s %12s %10s\n",
+          "site", "acquired", "contended", "wait ms", "max us",
+          "hold ms", "max us");
+  for (size_t i = 0; i < v.size(); i++){
+    sthread_site_t *s = v[i];
+    char label[128];
+    snprintf(label, sizeof(label), "%s:%d %s", s->file, s->line, s->func);
+    fprintf(stderr, "%-44s %10lu %10lu %12.3f %10.1f %12.3f %10.1f\n",
+            label, s->acquisitions, s->contended,
+            s->wait_ns / 1e6, s->max_wait_ns / 1e3,
+            s->hold_ns / 1e6, s->max_hold_ns / 1e3);
+  }
+}
+
+static void
+report_conds(const char *title, std::vector<sthread_site_t *> &v)
+{
+  std::sort(v.begin(), v.end(), by_waits);
+  fprintf(stderr, "\n%s\n", title);
+  fprintf(stderr, "%-44s %10s %10s %10s %10s %10s\n",
+          "site", "waits", "wakeups", "spurious", "signals", "broadcasts");
+  for (size_t i = 0; i < v.size(); i++){
+    sthread_site_t *s = v[i];
+    char label[128];
+    snprintf(label, sizeof(label), "%s:%d %s", s->file, s->line, s->func);
+    fprintf(stderr, "%-44s %10lu %10lu %10lu %10lu %10lu\n",
+            label, s->waits, s->wakeups, s->spurious,
+            s->signals, s->broadcasts);
+  }
+}
+
+/*
+ * Print every site's statistics, most contended first. Runs at
+ * exit; threads still running may make the numbers slightly
+ * inconsistent.
+ */
+static void
+report()
+{
+  std::vector<sthread_site_t *> byKind[4];
+  for (sthread_site_t *s = __atomic_load_n(&sites, __ATOMIC_ACQUIRE);
+       s != NULL; s = s->next){
+    byKind[s->kind].push_back(s);
+  }
+  fprintf(stderr, "\n==== sthread lock profile ====\n");
+  report_locks("Mutexes by creation site", byKind[STHREAD_SITE_MUTEX]);
+  report_locks("Mutexes by lock site", byKind[STHREAD_SITE_LOCK]);
+  report_conds("Condition variables by creation site", byKind[STHREAD_SITE_COND]);
+  report_conds("Condition variables by wait site", byKind[STHREAD_SITE_WAIT]);
+}
+
+#endif /* STHREAD_PROFILE */
+
+
+/*
+ * The CPUs sthread_set_placement chose for each kind of thread, in
+ * the order they are handed out, and how many have been handed out.
+ * Both lists are empty when threads are not placed.
+ */
+static std::vector<int> workerCpus;
+static std::vector<int> dedicatedCpus;
+static unsigned long nextWorker = 0;
+static unsigned long nextDedicated = 0;
+
+struct cpu_info {
+  int cpu;
+  int package;
+  int core;
+  int sibling;          /* rank among the SMT siblings of the core */
+  int coreRank;         /* rank of the core within the package */
+};
+
+/*
+ * Read a topology attribute of cpu from sysfs, or return dflt if
+ * the kernel does not export it.
+ */
+static int
+read_topology(int cpu, const char *name, int dflt)
+{
+  char path[128];
+  snprintf(path, sizeof(path),
+           "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+  FILE *f = fopen(path, "r");
+  if(f == NULL){
+    return dflt;
+  }
+  int value;
+  if(fscanf(f, "%d", &value) != 1){
+    value = dflt;
+  }
+  fclose(f);
+  return value;
+}
+
+/*
+ * Parse a CPU list such as "0-3,8" into set. Returns false if the
+ * list is malformed.
+ */
+static bool
+parse_cpus(const char *list, cpu_set_t *set)
+{
+  CPU_ZERO(set);
+  const char *p = list;
+  while(*p != '\0'){
+    char *end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if(end == p){
+      return false;
+    }
+    p = end;
+    if(*p == '-'){
+      last = strtol(p + 1, &end, 10);
+      if(end == p + 1){
+        return false;
+      }
+      p = end;
+    }
+    if(first < 0 || last < first || last >= CPU_SETSIZE){
+      return false;
+    }
+    for(long cpu = first; cpu <= last; cpu++){
+      CPU_SET(cpu, set);
+    }
+    if(*p == ','){
+      p++;
+    } else if(*p != '\0'){
+      return false;
+    }
+  }
+  return true;
+}
+
+int sthread_set_placement(int policy, int dedicated, const char *cpus)
+{
+  workerCpus.clear();
+  dedicatedCpus.clear();
+  if(policy == STHREAD_PLACE_NONE){
+    return 0;
+  }
+  assert(policy == STHREAD_PLACE_PACK || policy == STHREAD_PLACE_SPREAD);
+
+  cpu_set_t allowed;
+  if(sched_getaffinity(0, sizeof(allowed), &allowed)){
+    perror("sched_getaffinity failed");
+    exit(-1);
+  }
+  cpu_set_t wanted = allowed;
+  if(cpus != NULL && !parse_cpus(cpus, &wanted)){
+    return -1;
+  }
+
+  std::vector<cpu_info> info;
+  for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+    if(!CPU_ISSET(cpu, &wanted)){
+      continue;
+    }
+    if(!CPU_ISSET(cpu, &allowed)){
+      return -1;
+    }
+    cpu_info ci;
+    ci.cpu = cpu;
+    ci.package = read_topology(cpu, "physical_package_id", 0);
+    ci.core = read_topology(cpu, "core_id", cpu);
+    info.push_back(ci);
+  }
+  if((int) info.size() <= dedicated){
+    return -1;
+  }
+
+  // Number the SMT siblings of each core and the cores of each
+  // package, in CPU order.
+  std::sort(info.begin(), info.end(),
+            [](const cpu_info &a, const cpu_info &b){
+              if(a.package != b.package) return a.package < b.package;
+              if(a.core != b.core) return a.core < b.core;
+              return a.cpu < b.cpu;
+            });
+  for(size_t i = 0; i < info.size(); i++){
+    bool samePackage = i > 0 && info[i].package == info[i - 1].package;
+    bool sameCore = samePackage && info[i].core == info[i - 1].core;
+    info[i].sibling = sameCore ? info[i - 1].sibling + 1 : 0;
+    info[i].coreRank = !samePackage ? 0
+                     : sameCore ? info[i - 1].coreRank
+                     : info[i - 1].coreRank + 1;
+  }
+  // That order is already the packed one; spreading takes the first
+  // sibling of every core before any second one, and alternates
+  // between packages.
+  if(policy == STHREAD_PLACE_SPREAD){
+    std::stable_sort(info.begin(), info.end(),
+                     [](const cpu_info &a, const cpu_info &b){
+                       if(a.sibling != b.sibling) return a.sibling < b.sibling;
+                       if(a.coreRank != b.coreRank) return a.coreRank < b.coreRank;
+                       return a.package < b.package;
+                     });
+  }
+
+  size_t workers = info.size() - dedicated;
+  for(size_t i = 0; i < info.size(); i++){
+    (i < workers ? workerCpus : dedicatedCpus).push_back(info[i].cpu);
+  }
+  return info.size();
+}
+
+/*
+ * Pin the thread about to be created with attr to the next CPU in
+ * cpus (or in workerCpus if no CPUs are dedicated), if threads are
+ * being placed.
+ */
+static void
+place(pthread_attr_t *attr, std::vector<int> *cpus, unsigned long *next)
+{
+  if(cpus->empty()){
+    cpus = &workerCpus;
+    next = &nextWorker;
+  }
+  if(cpus->empty()){
+    return;
+  }
+  unsigned long n = __atomic_fetch_add(next, 1, __ATOMIC_RELAXED);
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET((*cpus)[n % cpus->size()], &set);
+  if(pthread_attr_setaffinity_np(attr, sizeof(set), &set)){
+    perror("pthread_attr_setaffinity_np failed");
+    exit(-1);
+  }
+}
 
 void sthread_create(sthread_t *thread,
 		    void (*start_routine(void*)), 
@@ -110,13 +849,29 @@ void sthread_create(sthread_t *thread,
   pthread_attr_t attr;
   pthread_attr_init(&attr);
   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+  place(&attr, &workerCpus, &nextWorker);
 
   if(pthread_create(thread, &attr, start_routine, argToStartRoutine)){
       perror("pthread_create failed");
       exit(-1);
   }
+  pthread_attr_destroy(&attr);
+}
 
+void sthread_create_dedicated(sthread_t *thread,
+			      void (*start_routine(void*)),
+			      void *argToStartRoutine)
+{
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+  place(&attr, &dedicatedCpus, &nextDedicated);
 
+  if(pthread_create(thread, &attr, start_routine, argToStartRoutine)){
+      perror("pthread_create failed");
+      exit(-1);
+  }
+  pthread_attr_destroy(&attr);
 }
 
 void sthread_exit(void)
@@ -129,6 +884,13 @@ void sthread_join(sthread_t thrd)
   pthread_join(thrd, NULL);
 }
 
+uint64_t sthread_now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 
 /*
  * WARNING:
@@ -154,25 +916,60 @@ void sthread_sleep(unsigned int seconds, unsigned int nanoseconds)
 
 
 /*
- * random() in stdlib.h is not MT-safe, so we need to lock
- * it.
+ * sutil_random keeps one xoshiro256** state per thread, so there is
+ * nothing to lock. States are derived with splitmix64 from the
+ * master seed and a stream number.
  */
-pthread_mutex_t  sulock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t masterSeed = 0x853c49e6748fea9bull;
+static uint64_t nextAutoStream = 1ull << 32;
+static __thread uint64_t rngState[4];
+static __thread int rngSeeded = 0;
 
-long sutil_random()
+static uint64_t
+splitmix64(uint64_t *x)
+{
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static inline uint64_t
+rotl(uint64_t x, int k)
 {
-  long val;
+  return (x << k) | (x >> (64 - k));
+}
 
-  
-  if(pthread_mutex_lock(&sulock)){
-    perror("random lock");
-    exit(-1);
+void sutil_seed(uint64_t master)
+{
+  __atomic_store_n(&masterSeed, master, __ATOMIC_RELAXED);
+}
+
+void sutil_seed_thread(uint64_t stream)
+{
+  uint64_t x = __atomic_load_n(&masterSeed, __ATOMIC_RELAXED);
+  x ^= splitmix64(&stream);
+  for (int i = 0; i < 4; i++){
+    rngState[i] = splitmix64(&x);
   }
-  val = random();
-  if(pthread_mutex_unlock(&sulock)){
-    perror("random unlock");
-    exit(-1);
+  rngSeeded = 1;
+}
+
+long sutil_random()
+{
+  if (!rngSeeded){
+    sutil_seed_thread(__atomic_fetch_add(&nextAutoStream, 1, __ATOMIC_RELAXED));
   }
-  return val;
-    
+  uint64_t *s = rngState;
+  uint64_t result = rotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+
+  // Same range as random(): [0, 2^31).
+  return (long) (result >> 33);
 }
@@ -9,11 +9,80 @@ nanosleep}.
 */
 
 #include <pthread.h>
+#include <stdint.h>
 #include <unistd.h>
 
+/*
+ * Size of a cache line. Data written by different threads should be
+ * at least this far apart to avoid false sharing.
+ */
+#define CACHE_LINE_SIZE 64
+
+/*
+ * Hint to the CPU that we are busy-waiting.
+ */
+static inline void
+cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+typedef pthread_t sthread_t;
+
+#if defined(STHREAD_FUTEX) && defined(STHREAD_PROFILE)
+#error "STHREAD_FUTEX and STHREAD_PROFILE cannot be combined"
+#endif
+
+#if defined(STHREAD_FUTEX)
+
+/*
+ * Futex build (compile everything with -DSTHREAD_FUTEX; Linux only).
+ *
+ * smutex_t is a three-state futex word: 0 unlocked, 1 locked, 2
+ * locked and somebody may be asleep on it. An uncontended lock and
+ * unlock are one atomic instruction each and never enter the
+ * kernel. A thread that finds the mutex held spins for a while
+ * before sleeping; spins tracks how long recent acquisitions had to
+ * spin, and the next one spins for up to about twice that (at most
+ * SMUTEX_MAX_SPIN rounds), so mutexes that are held briefly are
+ * spun on and the others are slept on.
+ *
+ * scond_t is a sequence number that waiters sleep on, plus a count
+ * of waiters (guarded by the mutex) so that signalling a condition
+ * variable nobody waits on stays out of the kernel. scond_broadcast
+ * wakes one waiter and moves the rest straight onto the mutex's
+ * futex (FUTEX_CMP_REQUEUE), so they are woken one at a time as the
+ * mutex is handed on instead of all at once to fight over it. All
+ * waiters on a condition variable must therefore use the mutex that
+ * is passed to scond_broadcast.
+ */
+
+#define SMUTEX_MAX_SPIN 100
+
+typedef struct {
+    int state;
+    int spins;
+} smutex_t;
+
+typedef struct {
+    int seq;
+    int waiters;
+} scond_t;
+
+#define SMUTEX_INITIALIZER { 0, 0 }
+
+#elif !defined(STHREAD_PROFILE)
+
 typedef pthread_mutex_t smutex_t;
 typedef pthread_cond_t scond_t;
-typedef pthread_t sthread_t;
+
+#define SMUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+
+#endif /* STHREAD_FUTEX */
+
+#ifndef STHREAD_PROFILE
 
 void smutex_init(smutex_t *mutex);
 void smutex_destroy(smutex_t *mutex);
@@ -35,13 +104,142 @@ void scond_signal(scond_t *cond, smutex_t *mutex);
 void scond_broadcast(scond_t *cond, smutex_t *mutex);
 void scond_wait(scond_t *cond, smutex_t *mutex);
 
+/*
+ * Like scond_wait, but give up waiting at deadline (a
+ * sthread_now_ns time). Returns false if the deadline passed
+ * first. As with scond_wait, re-check the predicate either way.
+ */
+bool scond_timedwait(scond_t *cond, smutex_t *mutex, uint64_t deadline);
+
+#else /* STHREAD_PROFILE */
+
+/*
+ * Instrumented build (compile everything with -DSTHREAD_PROFILE).
+ *
+ * Every smutex_init, smutex_lock, scond_init and scond_wait call
+ * site gets a static sthread_site_t that accumulates statistics,
+ * labelled with its file, line and function. Mutexes are accounted
+ * both to the site that initialized them (so, e.g., all item locks
+ * add up under one label) and to the site that acquired them; the
+ * same goes for condition variables and their wait sites. A report
+ * sorted by lock wait time is written to stderr at exit.
+ *
+ * A wakeup counts as spurious when the thread waits on the same
+ * condition variable again without unlocking the mutex in between,
+ * i.e. it re-checked its predicate and found nothing to do.
+ */
+
+enum sthread_site_kind {
+    STHREAD_SITE_MUTEX,         /* smutex_init */
+    STHREAD_SITE_LOCK,          /* smutex_lock */
+    STHREAD_SITE_COND,          /* scond_init */
+    STHREAD_SITE_WAIT           /* scond_wait */
+};
+
+typedef struct sthread_site {
+    const char *file;
+    int line;
+    const char *func;
+    int kind;
+
+    int registered;
+    struct sthread_site *next;
+
+    unsigned long acquisitions;
+    unsigned long contended;
+    unsigned long long wait_ns;
+    unsigned long long max_wait_ns;
+    unsigned long long hold_ns;
+    unsigned long long max_hold_ns;
+
+    unsigned long waits;
+    unsigned long wakeups;
+    unsigned long spurious;
+    unsigned long signals;
+    unsigned long broadcasts;
+} sthread_site_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    sthread_site_t *site;       /* where it was initialized */
+    sthread_site_t *held_at;    /* where the holder locked it */
+    unsigned long long acquired_ns;
+} smutex_t;
+
+typedef struct {
+    pthread_cond_t cond;
+    sthread_site_t *site;
+} scond_t;
+
+#define SMUTEX_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0 }
+
+#define STHREAD_SITE(kind_) \
+    ({ static sthread_site_t site_ = { __FILE__, __LINE__, __func__, (kind_) }; \
+       &site_; })
+
+void smutex_init_at(smutex_t *mutex, sthread_site_t *site);
+void smutex_destroy(smutex_t *mutex);
+void smutex_lock_at(smutex_t *mutex, sthread_site_t *site);
+void smutex_unlock(smutex_t *mutex);
+
+void scond_init_at(scond_t *cond, sthread_site_t *site);
+void scond_destroy(scond_t *cond);
+void scond_signal(scond_t *cond, smutex_t *mutex);
+void scond_broadcast(scond_t *cond, smutex_t *mutex);
+void scond_wait_at(scond_t *cond, smutex_t *mutex, sthread_site_t *site);
+bool scond_timedwait_at(scond_t *cond, smutex_t *mutex, uint64_t deadline,
+                        sthread_site_t *site);
+
+#define smutex_init(m)   smutex_init_at((m), STHREAD_SITE(STHREAD_SITE_MUTEX))
+#define smutex_lock(m)   smutex_lock_at((m), STHREAD_SITE(STHREAD_SITE_LOCK))
+#define scond_init(c)    scond_init_at((c), STHREAD_SITE(STHREAD_SITE_COND))
+#define scond_wait(c, m) scond_wait_at((c), (m), STHREAD_SITE(STHREAD_SITE_WAIT))
+#define scond_timedwait(c, m, d) \
+    scond_timedwait_at((c), (m), (d), STHREAD_SITE(STHREAD_SITE_WAIT))
+
+#endif /* STHREAD_PROFILE */
 
 
 void sthread_create(sthread_t *thrd,
 		    void *(start_routine(void*)), 
 		    void *argToStartRoutine);
+void sthread_create_dedicated(sthread_t *thrd,
+			      void *(start_routine(void*)),
+			      void *argToStartRoutine);
 void sthread_exit(void);
 
+/*
+ * Thread placement. By default threads run wherever the kernel
+ * puts them. After sthread_set_placement, every new thread is
+ * pinned to one CPU, taken in turn from an order that depends on
+ * the policy:
+ *
+ *      STHREAD_PLACE_PACK   - SMT siblings of a core, then the
+ *                             other cores of the socket, then the
+ *                             next socket, so threads share caches.
+ *      STHREAD_PLACE_SPREAD - one thread per core, alternating
+ *                             between sockets, before doubling up
+ *                             on SMT siblings.
+ *
+ * The CPUs are those in cpus (a list such as "0-3,8"), or all the
+ * CPUs the process may run on if cpus is NULL. The last dedicated
+ * CPUs of the order are kept for threads started with
+ * sthread_create_dedicated (e.g. request generators); all other
+ * threads share the rest. If dedicated is 0, both kinds of thread
+ * share all the CPUs.
+ *
+ * Call before creating the threads to be placed. Returns the
+ * number of CPUs in the order, or -1 if cpus cannot be parsed,
+ * names no usable CPU, or leaves none besides the dedicated ones.
+ */
+enum sthread_placement {
+    STHREAD_PLACE_NONE = 0,
+    STHREAD_PLACE_PACK,
+    STHREAD_PLACE_SPREAD
+};
+
+int sthread_set_placement(int policy, int dedicated, const char *cpus);
+
 /*
  * Block until the specified thread exits. If the thread has
  * already exited, this function returns immediately.
@@ -60,11 +258,27 @@ void sthread_join(sthread_t thrd);
  */
 void sthread_sleep(unsigned int seconds, unsigned int nanoseconds);
 
+/*
+ * The current CLOCK_MONOTONIC time in nanoseconds, the clock that
+ * scond_timedwait deadlines are measured on.
+ */
+uint64_t sthread_now_ns(void);
+
 
 /*
- * The normal random() library is not thread safe,
- * so we add a wrapper with locks.
+ * The normal random() library is not thread safe, so we
+ * add a per-thread generator instead. sutil_random returns
+ * values in [0, 2^31), like random().
+ *
+ * Every thread's stream is derived from the master seed
+ * (sutil_seed, set before any thread draws) and a stream
+ * number. A thread that calls sutil_seed_thread gets the
+ * same sequence on every run with the same master seed;
+ * other threads are given fresh stream numbers the first
+ * time they draw.
  */
+void sutil_seed(uint64_t master);
+void sutil_seed_thread(uint64_t stream);
 long sutil_random(void);
 
 #endif